@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // pipe2, O_CLOEXEC and the other Linux specific interfaces
+
 #include <unistd.h>
 #include <sys/wait.h>
 #include <stdio.h>
@@ -15,8 +17,30 @@
 
 #include <dirent.h>
 #include <sys/resource.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <spawn.h>
+#include <time.h>
+#include <stdio_ext.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <fnmatch.h>
+#include <regex.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define finit_module(module_descriptor, params, flags) syscall(__NR_finit_module, module_descriptor, params, flags)
 #define delete_module(module_name, flags) syscall(__NR_delete_module, module_name, flags)
@@ -24,12 +48,13 @@
 #define IOCTL_PID_READ _IOW('p', 1, int32_t*)
 
 const char *sysname = "shellfyre";
-//Global variables to hold the path the shell started in.
-char historyFilePath[1024];
-char absoluteHistoryFilePath[1024];
+//Global variable to hold the directory history file in the path the shell started in,
+//filled on first use by directory_history_path().
 char absolutePath[1024];
 
 static int driver_installed = 0;
+// exit status of the last command, returned by the shell in script and -c mode
+static int last_status = 0;
 
 enum return_codes
 {
@@ -49,6 +74,297 @@ struct command_t
 	struct command_t *next; // for piping
 };
 
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+struct arena_block
+{
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+	max_align_t data[]; // keeps every allocation suitably aligned
+};
+
+/*
+ * Bump allocator. Blocks are kept across resets, so after the first few lines parsing
+ * allocates nothing from malloc and releasing a whole parse tree is O(1).
+ */
+struct arena
+{
+	struct arena_block *first;
+	struct arena_block *current;
+	void *last; // most recent allocation, the only one arena_grow can extend in place
+	bool failed; // an allocation failed since the last reset
+};
+
+// holds the parse tree (commands, args, redirects, pipeline stages) of the current line
+static struct arena line_arena;
+
+/**
+ * Allocates size bytes from the arena.
+ * @param  arena arena to allocate from
+ * @param  size  number of bytes
+ * @return       pointer valid until the next arena_reset(), NULL when out of memory
+ *               (already reported)
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+
+	struct arena_block *block = arena->current;
+	while (block != NULL && block->used + size > block->size)
+	{
+		// move on to a block kept from an earlier line, resetting it lazily
+		block = block->next;
+		if (block != NULL)
+			block->used = 0;
+	}
+
+	if (block == NULL)
+	{
+		size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		block = malloc(sizeof(struct arena_block) + blockSize);
+		if (block == NULL)
+		{
+			printf("-%s: %s\n", sysname, strerror(errno));
+			arena->failed = true;
+			return NULL;
+		}
+		block->size = blockSize;
+		block->used = 0;
+		block->next = NULL;
+		if (arena->current != NULL)
+		{
+			// keep the chain: the new block goes after the one that filled up
+			block->next = arena->current->next;
+			arena->current->next = block;
+		}
+		else
+		{
+			block->next = arena->first;
+			arena->first = block;
+		}
+	}
+
+	arena->current = block;
+	void *ptr = (char *)block->data + block->used;
+	block->used += size;
+	arena->last = ptr;
+	return ptr;
+}
+
+/**
+ * Allocates size zeroed bytes from the arena.
+ */
+void *arena_zalloc(struct arena *arena, size_t size)
+{
+	void *ptr = arena_alloc(arena, size);
+	return ptr != NULL ? memset(ptr, 0, size) : NULL;
+}
+
+/**
+ * Copies len bytes of str into the arena and NUL terminates the copy.
+ */
+char *arena_strndup(struct arena *arena, const char *str, size_t len)
+{
+	char *copy = arena_alloc(arena, len + 1);
+	if (copy == NULL)
+		return NULL;
+	memcpy(copy, str, len);
+	copy[len] = 0;
+	return copy;
+}
+
+/**
+ * Resizes an arena allocation, in place when it is the most recent one.
+ * @param  arena   arena ptr was allocated from
+ * @param  ptr     allocation to grow, may be NULL
+ * @param  oldSize current size of ptr
+ * @param  newSize requested size
+ * @return         pointer to the resized allocation
+ */
+void *arena_grow(struct arena *arena, void *ptr, size_t oldSize, size_t newSize)
+{
+	struct arena_block *block = arena->current;
+
+	if (ptr != NULL && ptr == arena->last)
+	{
+		size_t offset = (char *)ptr - (char *)block->data;
+		size_t aligned = (newSize + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+		if (offset + aligned <= block->size)
+		{
+			block->used = offset + aligned;
+			return ptr;
+		}
+	}
+
+	void *grown = arena_alloc(arena, newSize);
+	if (ptr != NULL && grown != NULL)
+		memcpy(grown, ptr, oldSize);
+	return grown;
+}
+
+/**
+ * Releases everything allocated from the arena in O(1), the blocks stay for reuse.
+ */
+void arena_reset(struct arena *arena)
+{
+	arena->current = arena->first;
+	arena->last = NULL;
+	arena->failed = false;
+	if (arena->first != NULL)
+		arena->first->used = 0;
+}
+
+/*
+ * Hot path counters. Every instrumented phase keeps a count, the total and maximum time
+ * and a log2 histogram of its latencies (bucket n counts samples of 2^n to 2^(n+1) ns),
+ * so recording a sample is a clock read and a few additions. The shellstats builtin
+ * prints them and SHELLFYRE_STATS dumps them when the shell exits. Built with
+ * -DSHELLFYRE_USDT every sample also fires the USDT probe shellfyre:phase(phase, ns)
+ * for perf and bpftrace.
+ */
+#ifdef SHELLFYRE_USDT
+#include <sys/sdt.h>
+#define STAT_PROBE(phase, ns) DTRACE_PROBE2(shellfyre, phase, phase, ns)
+#else
+#define STAT_PROBE(phase, ns)
+#endif
+
+enum stat_phases
+{
+	STAT_PROMPT = 0,  // terminal setup and drawing the prompt
+	STAT_PARSE = 1,	  // parse_command
+	STAT_PATH = 2,	  // PATH resolution through the cache
+	STAT_SPAWN = 3,	  // launch_program, until the program runs
+	STAT_EXEC = 4,	  // fork launcher only: fork returned until execv succeeded
+	STAT_WAIT = 5,	  // waiting for foreground jobs
+	STAT_HISTORY = 6, // command and directory history file I/O
+	STAT_COUNT = 7,
+};
+
+static const char *stat_names[STAT_COUNT] = {"prompt", "parse", "path", "spawn", "exec", "wait", "history"};
+
+#define STAT_BUCKETS 48
+
+struct stat_counter
+{
+	uint64_t count;
+	uint64_t total; // ns
+	uint64_t max;	// ns
+	uint32_t buckets[STAT_BUCKETS];
+};
+
+static struct stat_counter shell_stats[STAT_COUNT];
+
+/**
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Adds one latency sample to a phase.
+ * @param phase one of the STAT_* phases
+ * @param ns    duration in nanoseconds
+ */
+static inline void stat_record(int phase, long long ns)
+{
+	struct stat_counter *counter = &shell_stats[phase];
+	uint64_t value = ns > 0 ? ns : 0;
+	int bucket = 63 - __builtin_clzll(value | 1);
+
+	counter->count++;
+	counter->total += value;
+	if (value > counter->max)
+		counter->max = value;
+	counter->buckets[bucket < STAT_BUCKETS ? bucket : STAT_BUCKETS - 1]++;
+	STAT_PROBE(phase, ns);
+}
+
+/**
+ * Estimates a percentile of a phase from its histogram.
+ * @return upper bound of the bucket holding the percentile, in nanoseconds
+ */
+uint64_t stat_percentile(const struct stat_counter *counter, double percentile)
+{
+	uint64_t rank = (uint64_t)(counter->count * percentile), seen = 0;
+	for (int i = 0; i < STAT_BUCKETS; ++i)
+	{
+		seen += counter->buckets[i];
+		if (seen > rank)
+		{
+			uint64_t bound = 2ULL << i;
+			return bound < counter->max ? bound : counter->max;
+		}
+	}
+	return counter->max;
+}
+
+/**
+ * Prints the counters, with one histogram per phase if histograms is set.
+ */
+void stat_print(FILE *out, bool histograms)
+{
+	fprintf(out, "%-8s %10s %12s %10s %10s %10s %10s\n", "phase", "count", "total(ms)", "mean(us)", "p50(us)",
+			"p99(us)", "max(us)");
+	for (int phase = 0; phase < STAT_COUNT; ++phase)
+	{
+		const struct stat_counter *counter = &shell_stats[phase];
+		fprintf(out, "%-8s %10llu %12.3f %10.1f %10.1f %10.1f %10.1f\n", stat_names[phase],
+				(unsigned long long)counter->count, counter->total / 1e6,
+				counter->count ? counter->total / 1e3 / counter->count : 0.0,
+				stat_percentile(counter, 0.5) / 1e3, stat_percentile(counter, 0.99) / 1e3, counter->max / 1e3);
+	}
+
+	if (!histograms)
+		return;
+	for (int phase = 0; phase < STAT_COUNT; ++phase)
+	{
+		const struct stat_counter *counter = &shell_stats[phase];
+		uint32_t most = 0;
+		for (int i = 0; i < STAT_BUCKETS; ++i)
+			if (counter->buckets[i] > most)
+				most = counter->buckets[i];
+		if (most == 0)
+			continue;
+
+		fprintf(out, "\n%s\n", stat_names[phase]);
+		for (int i = 0; i < STAT_BUCKETS; ++i)
+		{
+			if (counter->buckets[i] == 0)
+				continue;
+			int width = (int)(40.0 * counter->buckets[i] / most);
+			fprintf(out, "%12.1fus %8u |%.*s\n", (1ULL << i) / 1e3, counter->buckets[i], width > 0 ? width : 1,
+					"########################################");
+		}
+	}
+}
+
+static pid_t stat_owner; // only the shell itself dumps, not forked children that exit()
+
+/**
+ * atexit handler for SHELLFYRE_STATS: "1" prints the counters to stderr, anything else
+ * names a file they are appended to.
+ */
+void stat_dump_at_exit()
+{
+	const char *target = getenv("SHELLFYRE_STATS");
+	if (getpid() != stat_owner || target == NULL)
+		return;
+
+	FILE *out = strcmp(target, "1") == 0 ? stderr : fopen(target, "a");
+	if (out == NULL)
+		return;
+	fflush(stdout);
+	stat_print(out, false);
+	if (out != stderr)
+		fclose(out);
+}
+
 /**
  * Prints a command struct
  * @param struct command_t *
@@ -72,1203 +388,6695 @@ void print_command(struct command_t *command)
 	}
 }
 
+// prompt pieces that take a syscall to find out, looked up once; cwd is refreshed by the
+// builtins that chdir since only the shell itself changes it
+struct prompt_cache
+{
+	bool ready;
+	const char *format; // SHELLFYRE_PROMPT or the default
+	char user[256];
+	char host[256];
+	char cwd[4096];
+	const char *cwdBase; // last component of cwd
+	long long elapsed;	 // wall clock time of the last command in ns, -1 if none
+};
+
+static struct prompt_cache prompt_cache = {.elapsed = -1};
+
+int job_count();
+
+/**
+ * Re-reads the working directory after the shell changed it.
+ */
+void prompt_update_cwd()
+{
+	if (getcwd(prompt_cache.cwd, sizeof(prompt_cache.cwd)) == NULL)
+		strcpy(prompt_cache.cwd, "?");
+	char *slash = strrchr(prompt_cache.cwd, '/');
+	prompt_cache.cwdBase = (slash && slash[1] != '\0') ? slash + 1 : prompt_cache.cwd;
+}
+
+/**
+ * Fills the prompt cache, called before the first prompt is shown.
+ */
+void prompt_init()
+{
+	const char *user = getenv("USER");
+	if (user == NULL)
+		user = getenv("LOGNAME");
+	snprintf(prompt_cache.user, sizeof(prompt_cache.user), "%s", user ? user : "?");
+
+	if (gethostname(prompt_cache.host, sizeof(prompt_cache.host)) == -1)
+		strcpy(prompt_cache.host, "?");
+	prompt_cache.host[sizeof(prompt_cache.host) - 1] = '\0';
+
+	prompt_cache.format = getenv("SHELLFYRE_PROMPT");
+	if (prompt_cache.format == NULL)
+		prompt_cache.format = "%u@%h:%w %s$ ";
+
+	prompt_update_cwd();
+	prompt_cache.ready = true;
+}
+
 /**
- * Release allocated memory of a command
- * @param  command [description]
- * @return         [description]
+ * Renders the prompt from the SHELLFYRE_PROMPT format, it is drawn by the line editor
+ * together with the line. Recognized escapes:
+ * %u user, %h host, %w working directory, %W its last component, %s shell name,
+ * %? exit status of the last command, %t its run time, %j number of jobs, %% a literal %.
+ * @param  out  buffer for the rendered prompt
+ * @param  size size of out
+ * @return      length of the prompt
  */
-int free_command(struct command_t *command)
+int show_prompt(char *out, size_t size)
 {
-	if (command->arg_count)
+	if (!prompt_cache.ready)
+		prompt_init();
+
+	size_t length = 0;
+	for (const char *f = prompt_cache.format; *f != '\0' && length < size - 1; f++)
 	{
-		for (int i = 0; i < command->arg_count; ++i)
-			free(command->args[i]);
-		free(command->args);
-	}
-	for (int i = 0; i < 3; ++i)
-		if (command->redirects[i])
-			free(command->redirects[i]);
-		if (command->next)
+		char number[32];
+		const char *piece = number;
+
+		if (*f != '%' || f[1] == '\0')
 		{
-			free_command(command->next);
-			command->next = NULL;
+			out[length++] = *f;
+			continue;
 		}
-		free(command->name);
-		free(command);
-		return 0;
+
+		switch (*++f)
+		{
+		case 'u':
+			piece = prompt_cache.user;
+			break;
+		case 'h':
+			piece = prompt_cache.host;
+			break;
+		case 'w':
+			piece = prompt_cache.cwd;
+			break;
+		case 'W':
+			piece = prompt_cache.cwdBase;
+			break;
+		case 's':
+			piece = sysname;
+			break;
+		case '?':
+			snprintf(number, sizeof(number), "%d", last_status);
+			break;
+		case 'j':
+			snprintf(number, sizeof(number), "%d", job_count());
+			break;
+		case 't':
+			if (prompt_cache.elapsed < 0)
+				piece = "";
+			else if (prompt_cache.elapsed < 1000000000LL)
+				snprintf(number, sizeof(number), "%lldms", prompt_cache.elapsed / 1000000);
+			else
+				snprintf(number, sizeof(number), "%.1fs", prompt_cache.elapsed / 1e9);
+			break;
+		case '%':
+			piece = "%";
+			break;
+		default: // unknown escapes are printed as they are
+			snprintf(number, sizeof(number), "%%%c", *f);
+			break;
+		}
+
+		size_t pieceLength = strlen(piece);
+		if (pieceLength > size - 1 - length)
+			pieceLength = size - 1 - length;
+		memcpy(out + length, piece, pieceLength);
+		length += pieceLength;
 	}
+	out[length] = '\0';
+	return length;
+}
+
+enum token_types
+{
+	TOKEN_WORD = 0,
+	TOKEN_PIPE = 1,		  // |
+	TOKEN_BACKGROUND = 2, // &
+	TOKEN_INPUT = 3,	  // <
+	TOKEN_OUTPUT = 4,	  // >
+	TOKEN_APPEND = 5,	  // >>
+};
+
+struct token_t
+{
+	int type;
+	char *text; // for words: the unquoted word, a NUL terminated slice of the line buffer
+	int length;
+};
 
 /**
- * Show the command prompt
- * @return [description]
+ * Recognizes an operator at str.
+ * @param  str    position in the line
+ * @param  length set to the number of characters the operator spans
+ * @return        token type or -1 if str does not start with an operator
  */
-	int show_prompt()
+int lex_operator(const char *str, int *length)
+{
+	*length = 1;
+	switch (str[0])
 	{
-		char cwd[1024], hostname[1024];
-		gethostname(hostname, sizeof(hostname));
-		getcwd(cwd, sizeof(cwd));
-		printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
-		return 0;
+	case '|':
+		return TOKEN_PIPE;
+	case '&':
+		return TOKEN_BACKGROUND;
+	case '<':
+		return TOKEN_INPUT;
+	case '>':
+		if (str[1] == '>')
+		{
+			*length = 2;
+			return TOKEN_APPEND;
+		}
+		return TOKEN_OUTPUT;
 	}
+	return -1;
+}
 
 /**
- * Parse a command string into a command struct
- * @param  buf     [description]
- * @param  command [description]
- * @return         0
+ * Splits a line into tokens in a single pass. Words are unquoted in place: quotes and
+ * escaping backslashes are squeezed out while scanning and each word is NUL terminated
+ * where it ends, so tokens point into buf and nothing is copied. Single quotes are
+ * literal, double quotes honor \" \\ \$ and \`, a backslash outside quotes escapes any
+ * character and an unquoted # starts a comment.
+ * @param  buf    line to be tokenized, modified in place
+ * @param  tokens set to an array of tokens allocated from line_arena
+ * @return        number of tokens, or -1 on an unterminated quote or when out of memory
+ *                (already reported)
  */
-	int parse_command(char *buf, struct command_t *command)
-	{
-	const char *splitters = " \t"; // split at whitespace
-	int index, len;
-	len = strlen(buf);
-	while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
-	{
-		buf++;
-		len--;
-	}
-	while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
-		buf[--len] = 0; // trim right whitespace
-
-	if (len > 0 && buf[len - 1] == '?') // auto-complete
-		command->auto_complete = true;
-	if (len > 0 && buf[len - 1] == '&') // background
-		command->background = true;
-
-	char *pch = strtok(buf, splitters);
-	
-	command->name = (char *)malloc(strlen(pch) + 1);
-	if (pch == NULL)
-		command->name[0] = 0;
-	else
-		strcpy(command->name, pch);
-
-	command->args = (char **)malloc(sizeof(char *));
-
-	int redirect_index;
-	int arg_index = 0;
-	char temp_buf[1024], *arg;
+int tokenize(char *buf, struct token_t **tokens)
+{
+	int count = 0, capacity = 16;
+	struct token_t *list = arena_alloc(&line_arena, sizeof(struct token_t) * capacity);
+	char *read = buf;
+	if (list == NULL)
+		return -1;
 
 	while (1)
 	{
-		// tokenize input on splitters
-		pch = strtok(NULL, splitters);
-		if (!pch)
+		while (*read == ' ' || *read == '\t' || *read == '\n' || *read == '\r')
+			read++;
+		if (*read == 0 || *read == '#')
 			break;
-		arg = temp_buf;
-		strcpy(arg, pch);
-		len = strlen(arg);
 
-		if (len == 0)
-			continue;										 // empty arg, go for next
-		while (len > 0 && strchr(splitters, arg[0]) != NULL) // trim left whitespace
+		// room for a word and the operator that may terminate it
+		if (count + 2 > capacity)
 		{
-			arg++;
-			len--;
+			list = arena_grow(&line_arena, list, sizeof(struct token_t) * capacity,
+							  sizeof(struct token_t) * capacity * 2);
+			if (list == NULL)
+				return -1;
+			capacity *= 2;
 		}
-		while (len > 0 && strchr(splitters, arg[len - 1]) != NULL)
-			arg[--len] = 0; // trim right whitespace
-		if (len == 0)
-			continue; // empty arg, go for next
 
-		// piping to another command
-		if (strcmp(arg, "|") == 0)
+		int length;
+		int type = lex_operator(read, &length);
+		if (type >= 0)
 		{
-			struct command_t *c = malloc(sizeof(struct command_t));
-			int l = strlen(pch);
-			pch[l] = splitters[0]; // restore strtok termination
-			index = 1;
-			while (pch[index] == ' ' || pch[index] == '\t')
-				index++; // skip whitespaces
-
-			parse_command(pch + index, c);
-			pch[l] = 0; // put back strtok termination
-			command->next = c;
+			list[count].type = type;
+			list[count].text = NULL;
+			list[count++].length = length;
+			read += length;
 			continue;
 		}
 
-		// background process
-		if (strcmp(arg, "&") == 0)
-			continue; // handled before
+		char *word = read, *write = read;
+		char quote = 0;
 
-		// handle input redirection
-		redirect_index = -1;
-		if (arg[0] == '<')
-			redirect_index = 0;
-		if (arg[0] == '>')
+		while (*read)
 		{
-			if (len > 1 && arg[1] == '>')
+			char c = *read;
+			if (quote == '\'')
+			{
+				if (c == '\'')
+					quote = 0;
+				else
+					*write++ = c;
+				read++;
+			}
+			else if (quote == '"')
 			{
-				redirect_index = 2;
-				arg++;
-				len--;
+				if (c == '"')
+					quote = 0;
+				else if (c == '\\' && read[1] && strchr("\"\\$`", read[1]) != NULL)
+					*write++ = *++read;
+				else
+					*write++ = c;
+				read++;
 			}
+			else if (c == '\'' || c == '"')
+			{
+				quote = c;
+				read++;
+			}
+			else if (c == '\\' && read[1])
+			{
+				*write++ = read[1];
+				read += 2;
+			}
+			else if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || lex_operator(read, &length) >= 0)
+				break;
 			else
-				redirect_index = 1;
+				*write++ = *read++;
 		}
-		if (redirect_index != -1)
+
+		if (quote)
 		{
-			command->redirects[redirect_index] = malloc(len);
-			strcpy(command->redirects[redirect_index], arg + 1);
-			continue;
+			printf("-%s: unexpected EOF while looking for matching `%c'\n", sysname, quote);
+			return -1;
 		}
 
-		// normal arguments
-		if (len > 2 && ((arg[0] == '"' && arg[len - 1] == '"') || (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
+		// look at the terminating operator before the NUL may overwrite it
+		type = *read ? lex_operator(read, &length) : -1;
+		if (type < 0 && *read)
+			read++; // skip the whitespace the NUL can safely replace
+		*write = 0;
+
+		list[count].type = TOKEN_WORD;
+		list[count].text = word;
+		list[count++].length = write - word;
+
+		if (type >= 0)
 		{
-			arg[--len] = 0;
-			arg++;
+			list[count].type = type;
+			list[count].text = NULL;
+			list[count++].length = length;
+			read += length;
 		}
-		command->args = (char **)realloc(command->args, sizeof(char *) * (arg_index + 1));
-		command->args[arg_index] = (char *)malloc(len + 1);
-		strcpy(command->args[arg_index++], arg);
 	}
-	command->arg_count = arg_index;
-	return 0;
-}
 
-void prompt_backspace()
-{
-	putchar(8);	  // go back 1
-	putchar(' '); // write empty over
-	putchar(8);	  // go back 1 again
+	*tokens = list;
+	return count;
 }
 
 /**
- * Prompt a command from the user
- * @param  buf      [description]
- * @param  buf_size [description]
- * @return          [description]
+ * Parse a command string into a command struct. The line is tokenized by tokenize() and
+ * each stage of a pipeline becomes a command_t linked through next. Names, arguments and
+ * redirect targets point into buf, the structs and arrays come from line_arena.
+ * @param  buf     line to be parsed, must stay valid as long as the command is used
+ * @param  command command to fill, must be zeroed
+ * @return         0 on success, -1 on a syntax error (command is left empty)
  */
-int prompt(struct command_t *command)
+int parse_command(char *buf, struct command_t *command)
 {
-	int index = 0;
-	char c;
-	char buf[4096];
-	static char oldbuf[4096];
+	int len = strlen(buf);
+	while (len > 0 && strchr(" \t\r\n", buf[len - 1]) != NULL)
+		len--;
+	if (len > 0 && buf[len - 1] == '?') // auto-complete
+		command->auto_complete = true;
 
-	// tcgetattr gets the parameters of the current terminal
-	// STDIN_FILENO will tell tcgetattr that it should write the settings
-	// of stdin to oldt
-	static struct termios backup_termios, new_termios;
-	tcgetattr(STDIN_FILENO, &backup_termios);
-	new_termios = backup_termios;
-	// ICANON normally takes care that one line at a time will be processed
-	// that means it will return if it sees a "\n" or an EOF or an EOL
-	new_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo. We manually echo each char.
-	// Those new settings will be set to STDIN
-	// TCSANOW tells tcsetattr to change attributes immediately.
-	tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+	struct token_t *tokens;
+	int count = tokenize(buf, &tokens);
 
-	// FIXME: backspace is applied before printing chars
-	show_prompt();
-	int multicode_state = 0;
-	buf[0] = 0;
+	command->name = "";
+	if (count < 0)
+		return -1;
 
-	while (1)
-	{
-		c = getchar();
-		// printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
+	struct command_t *stage = command;
+	int index = 0;
 
-		if (c == 9) // handle tab
+	while (index < count)
+	{
+		// size the args array of this stage exactly before filling it
+		int words = 0;
+		bool named = false;
+		for (int i = index; i < count && tokens[i].type != TOKEN_PIPE; ++i)
+			if (tokens[i].type == TOKEN_WORD)
+				words++;
+		stage->args = arena_alloc(&line_arena, sizeof(char *) * (words ? words : 1));
+		stage->arg_count = 0;
+		if (stage->args == NULL)
 		{
-			buf[index++] = '?'; // autocomplete
-			break;
+			command->name = "";
+			command->next = NULL;
+			return -1;
 		}
 
-		if (c == 127) // handle backspace
+		for (; index < count && tokens[index].type != TOKEN_PIPE; ++index)
 		{
-			if (index > 0)
+			struct token_t *token = &tokens[index];
+
+			if (token->type == TOKEN_BACKGROUND)
 			{
-				prompt_backspace();
-				index--;
+				if (index != count - 1)
+				{
+					printf("-%s: syntax error near unexpected token `&'\n", sysname);
+					command->name = "";
+					command->next = NULL;
+					return -1;
+				}
+				command->background = true;
 			}
-			continue;
-		}
-		if (c == 27 && multicode_state == 0) // handle multi-code keys
-		{
-			multicode_state = 1;
-			continue;
-		}
-		if (c == 91 && multicode_state == 1)
-		{
-			multicode_state = 2;
-			continue;
-		}
-		if (c == 65 && multicode_state == 2) // up arrow
-		{
-			int i;
-			while (index > 0)
+			else if (token->type != TOKEN_WORD)
 			{
-				prompt_backspace();
-				index--;
+				// redirects[0] is <, redirects[1] is > and redirects[2] is >>
+				int redirect_index = token->type == TOKEN_INPUT ? 0 : token->type == TOKEN_OUTPUT ? 1 : 2;
+				if (index + 1 < count && tokens[index + 1].type == TOKEN_WORD)
+					stage->redirects[redirect_index] = tokens[++index].text;
+				else
+					stage->redirects[redirect_index] = ""; // reported when the redirect is opened
 			}
-			for (i = 0; oldbuf[i]; ++i)
+			else if (!named)
 			{
-				putchar(oldbuf[i]);
-				buf[i] = oldbuf[i];
+				stage->name = token->text;
+				named = true;
 			}
-			index = i;
-			continue;
+			else
+				stage->args[stage->arg_count++] = token->text;
 		}
-		else
-			multicode_state = 0;
 
-		putchar(c); // echo the character
-		buf[index++] = c;
-		if (index >= sizeof(buf) - 1)
-			break;
-		if (c == '\n') // enter key
-			break;
-		if (c == 4) // Ctrl+D
-			return EXIT;
+		if (index < count) // pipe, start the next stage
+		{
+			stage->next = arena_zalloc(&line_arena, sizeof(struct command_t));
+			if (stage->next == NULL)
+			{
+				command->name = "";
+				command->next = NULL;
+				return -1;
+			}
+			stage = stage->next;
+			stage->name = "";
+			index++;
+		}
 	}
-	if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
-		index--;
-	buf[index++] = 0; // null terminate string
+	return 0;
+}
 
-	strcpy(oldbuf, buf);
+/*
+ * Command history. Every line entered at the prompt is appended to a log file, one entry
+ * per line, in $SHELLFYRE_HISTFILE or ~/.shellfyre_history. The log is mapped into memory
+ * when history is first needed and the entries point into the mapping, so loading does
+ * not copy it. Lines entered later live in their own allocations.
+ *
+ * Reverse search uses a trigram index built on the first Ctrl+R: every trigram of every
+ * entry hashes to a bucket holding the ascending numbers of the entries that contain it.
+ * A search walks the shortest bucket among the query's trigrams from the newest entry
+ * backwards and only checks those candidates.
+ */
+#define HISTORY_BUCKETS 65536
 
-	parse_command(buf, command);
+struct history_entry
+{
+	const char *text; // not NUL terminated
+	uint32_t length;
+};
 
-	//print_command(command); // DEBUG: uncomment for debugging
+struct history_postings
+{
+	uint32_t *ids; // entry numbers, ascending
+	uint32_t count;
+	uint32_t capacity;
+};
 
-	// restore the old settings
-	tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
-	return SUCCESS;
-}
+struct history
+{
+	bool loaded;
+	int fd; // log opened for appending, -1 when history is not persisted
+	bool needsNewline; // the log ends in a torn entry
+	char *map;
+	size_t mapLength;
 
-int process_command(struct command_t *command);
+	struct history_entry *entries;
+	size_t count;
+	size_t capacity;
 
-//Helper to parse the file path. Adds escape characters to the file path.
-void formatFilePath(char* path);
+	struct history_postings *postings; // HISTORY_BUCKETS buckets, NULL until the first search
+};
 
-void recursiveFileSearch(char* path, bool open, char *argName, char *dirUntilNow);
+static struct history history = {.fd = -1};
 
-int main()
+/**
+ * Hashes the three bytes at text into a bucket of the trigram index.
+ */
+static inline uint32_t history_trigram(const char *text)
 {
-	getcwd(historyFilePath, sizeof(historyFilePath));
-	//Getting current directory that shell started and parsing the file path to handle escape characters.
-	strcat(historyFilePath, "/.directoryHistory.txt");
-	memcpy(absoluteHistoryFilePath, historyFilePath, sizeof(historyFilePath));
-	formatFilePath(historyFilePath);
-	//opening directoryHistory.txt.
-	FILE *fl = fopen(".directoryHistory.txt", "r");
-
-	//if file doesn't exits it creates it.
-	if(fl == NULL){
-		fl = fopen(".directoryHistory.txt", "w");
-		fputs(" ", fl);
-		fclose(fl);
-	}else{
-		fclose(fl);
-	}
+	uint32_t trigram = (unsigned char)text[0] << 16 | (unsigned char)text[1] << 8 | (unsigned char)text[2];
+	return (trigram * 2654435761u) >> 16;
+}
 
-	//canonicalized absolute pathname of the file, without the formats.
-	char *ptr = realpath(absoluteHistoryFilePath, absolutePath);
+/**
+ * Adds the trigrams of entry id to the index.
+ */
+void history_index_entry(uint32_t id)
+{
+	const struct history_entry *entry = &history.entries[id];
+	for (uint32_t i = 0; i + 3 <= entry->length; i++)
+	{
+		struct history_postings *bucket = &history.postings[history_trigram(entry->text + i)];
+		if (bucket->count > 0 && bucket->ids[bucket->count - 1] == id)
+			continue; // trigram repeated within the entry
+		if (bucket->count == bucket->capacity)
+		{
+			bucket->capacity = bucket->capacity ? bucket->capacity * 2 : 4;
+			bucket->ids = realloc(bucket->ids, bucket->capacity * sizeof(uint32_t));
+		}
+		bucket->ids[bucket->count++] = id;
+	}
+}
 
-	while (1)
+/**
+ * Appends an entry to the in-memory list.
+ */
+void history_push(const char *text, size_t length)
+{
+	if (history.count == history.capacity)
 	{
-		struct command_t *command = malloc(sizeof(struct command_t));
-		memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+		history.capacity = history.capacity ? history.capacity * 2 : 1024;
+		history.entries = realloc(history.entries, history.capacity * sizeof(struct history_entry));
+	}
+	history.entries[history.count].text = text;
+	history.entries[history.count].length = length;
+	history.count++;
 
+	if (history.postings != NULL)
+		history_index_entry(history.count - 1);
+}
+
+/**
+ * Opens the history log and maps the entries it already has, see history_load().
+ */
+void history_map()
+{
+	history.loaded = true;
+
+	char path[4096];
+	const char *file = getenv("SHELLFYRE_HISTFILE");
+	const char *home = getenv("HOME");
+	if (file != NULL)
+		snprintf(path, sizeof(path), "%s", file);
+	else if (home != NULL)
+		snprintf(path, sizeof(path), "%s/.shellfyre_history", home);
+	else
+		return;
+
+	history.fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if (history.fd == -1)
+		return;
+
+	struct stat st;
+	if (fstat(history.fd, &st) == -1 || st.st_size == 0)
+		return;
+	history.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, history.fd, 0);
+	if (history.map == MAP_FAILED)
+	{
+		history.map = NULL;
+		return;
+	}
+	history.mapLength = st.st_size;
+	madvise(history.map, history.mapLength, MADV_SEQUENTIAL);
+
+	const char *position = history.map, *end = history.map + history.mapLength;
+	while (position < end)
+	{
+		const char *newline = memchr(position, '\n', end - position);
+		const char *stop = newline ? newline : end;
+		if (stop > position)
+			history_push(position, stop - position);
+		position = stop + 1;
+	}
+	history.needsNewline = history.map[history.mapLength - 1] != '\n';
+}
+
+/**
+ * Opens and maps the history log on first use.
+ */
+void history_load()
+{
+	if (history.loaded)
+		return;
+	long long start = now_ns();
+	history_map();
+	stat_record(STAT_HISTORY, now_ns() - start);
+}
+
+/**
+ * Records an entered line, unless it is empty or repeats the previous entry.
+ */
+void history_add(const char *line, size_t length)
+{
+	history_load();
+	if (length == 0)
+		return;
+	if (history.count > 0)
+	{
+		const struct history_entry *last = &history.entries[history.count - 1];
+		if (last->length == length && memcmp(last->text, line, length) == 0)
+			return;
+	}
+
+	// the copy keeps a trailing newline so it can be appended to the log as it is
+	char *text = malloc(length + 1);
+	memcpy(text, line, length);
+	text[length] = '\n';
+	history_push(text, length);
+
+	if (history.fd == -1)
+		return;
+	long long start = now_ns();
+	if (history.needsNewline && write(history.fd, "\n", 1) == 1)
+		history.needsNewline = false;
+	if (write(history.fd, text, length + 1) != (ssize_t)length + 1)
+		history.needsNewline = true;
+	stat_record(STAT_HISTORY, now_ns() - start);
+}
+
+/**
+ * Finds the newest entry before entry number before that contains query.
+ * @return the entry number or -1 if there is no such entry
+ */
+long history_search(const char *query, size_t queryLength, size_t before)
+{
+	if (before > history.count)
+		before = history.count;
+
+	if (queryLength < 3)
+	{
+		// too short to have a trigram, these match often enough that scanning is fine
+		for (size_t id = before; id-- > 0;)
+			if (memmem(history.entries[id].text, history.entries[id].length, query, queryLength) != NULL)
+				return id;
+		return -1;
+	}
+
+	if (history.postings == NULL)
+	{
+		history.postings = calloc(HISTORY_BUCKETS, sizeof(struct history_postings));
+		for (size_t id = 0; id < history.count; id++)
+			history_index_entry(id);
+	}
+
+	// every match contains all trigrams of the query, so the smallest bucket is enough
+	const struct history_postings *bucket = NULL;
+	for (size_t i = 0; i + 3 <= queryLength; i++)
+	{
+		const struct history_postings *candidate = &history.postings[history_trigram(query + i)];
+		if (bucket == NULL || candidate->count < bucket->count)
+			bucket = candidate;
+	}
+
+	// binary search for the first posting at or after before
+	size_t low = 0, high = bucket->count;
+	while (low < high)
+	{
+		size_t middle = (low + high) / 2;
+		if (bucket->ids[middle] < before)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	while (low-- > 0)
+	{
+		const struct history_entry *entry = &history.entries[bucket->ids[low]];
+		if (memmem(entry->text, entry->length, query, queryLength) != NULL)
+			return bucket->ids[low];
+	}
+	return -1;
+}
+
+/*
+ * Job table. Every command that runs in child processes (external programs, pipelines and
+ * forked builtins) is a job. SIGCHLD stays blocked and is read from a signalfd instead of
+ * being handled asynchronously, so children are only reaped at well defined points: while
+ * the prompt waits for keys (epoll on the terminal and the signalfd), before every line
+ * and while waiting for a foreground job. Jobs that finish in the background are reported
+ * at the next prompt.
+ *
+ * An interactive shell also does job control: every job runs in its own process group,
+ * the foreground job owns the terminal and the shell ignores the job control signals.
+ */
+enum job_states
+{
+	JOB_RUNNING = 0,
+	JOB_STOPPED = 1,
+	JOB_DONE = 2,
+};
+
+struct job_process
+{
+	pid_t pid;
+	int status; // wait status once done
+	bool done;
+	bool stopped;
+};
+
+struct job_t
+{
+	int id; // number used as %id
+	pid_t pgid; // 0 until the first process starts, -1 without job control
+	char *text; // command line shown by jobs
+	struct job_process *processes;
+	int count;
+	int capacity;
+	int state;
+	bool background;
+	bool notify; // state change to be reported at the next prompt
+	bool savedModes;
+	struct termios modes; // terminal modes of a stopped job
+	struct rusage usage;  // summed over the processes that finished
+	struct job_t *next;
+};
+
+struct job_table
+{
+	struct job_t *first; // ordered by id
+	struct job_t *current; // job picked by fg and bg without an argument
+	bool control; // process groups and terminal handover
+	pid_t shellPgid;
+	struct termios shellModes;
+	int signalFd;
+	int epollFd;
+	bool warnedStopped; // exit was refused once because of stopped jobs
+	bool resized;		// SIGWINCH arrived, the line editor lays its line out again
+};
+
+static struct job_table jobs = {.signalFd = -1, .epollFd = -1};
+
+// resources used by the children of the command being run, see process_command()
+struct command_usage
+{
+	struct rusage children;
+	bool hasChildren;
+};
+
+static struct command_usage command_usage;
+
+// signals the interactive shell ignores and its children get back at their defaults
+static const int job_control_signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU};
+
+/**
+ * Converts a wait status into a shell exit status.
+ * @param  status status filled by waitpid
+ * @return        the exit code, or 128 + signal number for killed processes
+ */
+int exit_code(int status)
+{
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
+
+/**
+ * Adds the resource usage of a process to a total. Times and counters add up, the
+ * maximum resident set size is the largest of the two.
+ */
+void usage_add(struct rusage *total, const struct rusage *usage)
+{
+	timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+	timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+	if (usage->ru_maxrss > total->ru_maxrss)
+		total->ru_maxrss = usage->ru_maxrss;
+	total->ru_minflt += usage->ru_minflt;
+	total->ru_majflt += usage->ru_majflt;
+	total->ru_inblock += usage->ru_inblock;
+	total->ru_oublock += usage->ru_oublock;
+	total->ru_nvcsw += usage->ru_nvcsw;
+	total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+/**
+ * Counts a finished foreground process towards the command being run.
+ */
+void usage_add_child(const struct rusage *usage)
+{
+	usage_add(&command_usage.children, usage);
+	command_usage.hasChildren = true;
+}
+
+/**
+ * Sets up child reaping, and job control when the shell runs interactively.
+ * @param interactive whether commands are read from a terminal
+ */
+void job_init(bool interactive)
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	jobs.signalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+	if (!interactive)
+		return;
+
+	// wait until the shell is in the foreground before taking over the terminal
+	while (tcgetpgrp(STDIN_FILENO) != (jobs.shellPgid = getpgrp()))
+		kill(-jobs.shellPgid, SIGTTIN);
+
+	for (size_t i = 0; i < sizeof(job_control_signals) / sizeof(job_control_signals[0]); ++i)
+		signal(job_control_signals[i], SIG_IGN);
+
+	// terminal size changes arrive through the same signalfd as SIGCHLD
+	sigaddset(&mask, SIGWINCH);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	if (jobs.signalFd >= 0)
+		signalfd(jobs.signalFd, &mask, 0);
+
+	jobs.shellPgid = getpid();
+	if (getpgrp() != jobs.shellPgid && setpgid(0, jobs.shellPgid) < 0)
+		return;
+	tcsetpgrp(STDIN_FILENO, jobs.shellPgid);
+	tcgetattr(STDIN_FILENO, &jobs.shellModes);
+	jobs.control = true;
+
+	jobs.epollFd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event event = {.events = EPOLLIN};
+	event.data.fd = STDIN_FILENO;
+	epoll_ctl(jobs.epollFd, EPOLL_CTL_ADD, STDIN_FILENO, &event);
+	if (jobs.signalFd >= 0)
+	{
+		event.data.fd = jobs.signalFd;
+		epoll_ctl(jobs.epollFd, EPOLL_CTL_ADD, jobs.signalFd, &event);
+	}
+}
+
+/**
+ * Undoes the shell's signal setup in a forked child before it runs a command.
+ * @param pgid process group to join, 0 for a new one, -1 to stay in the shell's
+ */
+void job_child_init(pid_t pgid)
+{
+	if (pgid >= 0)
+		setpgid(0, pgid);
+	if (jobs.control)
+		for (size_t i = 0; i < sizeof(job_control_signals) / sizeof(job_control_signals[0]); ++i)
+			signal(job_control_signals[i], SIG_DFL);
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGWINCH);
+	sigprocmask(SIG_UNBLOCK, &mask, NULL);
+	if (jobs.signalFd >= 0)
+		close(jobs.signalFd);
+}
+
+/**
+ * Builds the command line shown by jobs from a parsed command.
+ */
+char *job_describe(struct command_t *command)
+{
+	static const char *operators[3] = {"<", ">", ">>"};
+	size_t size = 1;
+
+	for (struct command_t *stage = command; stage != NULL; stage = stage->next)
+	{
+		size += strlen(stage->name) + 3;
+		for (int i = 0; i < stage->arg_count; ++i)
+			size += strlen(stage->args[i]) + 1;
+		for (int i = 0; i < 3; ++i)
+			if (stage->redirects[i])
+				size += strlen(stage->redirects[i]) + 4;
+	}
+
+	char *text = malloc(size), *end = text;
+	for (struct command_t *stage = command; stage != NULL; stage = stage->next)
+	{
+		if (stage != command)
+			end = stpcpy(end, " | ");
+		end = stpcpy(end, stage->name);
+		for (int i = 0; i < stage->arg_count; ++i)
+			end += sprintf(end, " %s", stage->args[i]);
+		for (int i = 0; i < 3; ++i)
+			if (stage->redirects[i])
+				end += sprintf(end, " %s %s", operators[i], stage->redirects[i]);
+	}
+	*end = '\0';
+	return text;
+}
+
+/**
+ * Adds a job for command to the table. Its processes are added as they start.
+ */
+struct job_t *job_create(struct command_t *command)
+{
+	struct job_t *job = calloc(1, sizeof(struct job_t));
+	job->pgid = jobs.control ? 0 : -1;
+	job->text = job_describe(command);
+	job->background = command->background;
+
+	// the new job gets the lowest number above all current ones
+	struct job_t **link = &jobs.first;
+	job->id = 1;
+	while (*link != NULL)
+	{
+		job->id = (*link)->id + 1;
+		link = &(*link)->next;
+	}
+	*link = job;
+	return job;
+}
+
+/**
+ * Removes a job from the table and frees it.
+ */
+void job_remove(struct job_t *job)
+{
+	for (struct job_t **link = &jobs.first; *link != NULL; link = &(*link)->next)
+	{
+		if (*link == job)
+		{
+			*link = job->next;
+			break;
+		}
+	}
+	if (jobs.current == job)
+	{
+		// fall back to the newest stopped job, else the newest job
+		jobs.current = NULL;
+		for (struct job_t *other = jobs.first; other != NULL; other = other->next)
+			if (jobs.current == NULL || jobs.current->state != JOB_STOPPED || other->state == JOB_STOPPED)
+				jobs.current = other;
+	}
+	free(job->processes);
+	free(job->text);
+	free(job);
+}
+
+/**
+ * Records a started process of a job. The first process leads the job's process group.
+ * @return the process group later processes have to join
+ */
+pid_t job_add_process(struct job_t *job, pid_t pid)
+{
+	if (job->count == job->capacity)
+	{
+		job->capacity = job->capacity ? job->capacity * 2 : 4;
+		job->processes = realloc(job->processes, job->capacity * sizeof(struct job_process));
+	}
+	job->processes[job->count++] = (struct job_process){.pid = pid};
+
+	if (job->pgid == 0)
+		job->pgid = pid;
+	if (job->pgid > 0)
+		setpgid(pid, job->pgid); // the child does the same, whoever runs first wins
+	return job->pgid;
+}
+
+/**
+ * Exit status of a job, the status of its last process.
+ */
+int job_status(struct job_t *job)
+{
+	return job->count > 0 ? exit_code(job->processes[job->count - 1].status) : 0;
+}
+
+/**
+ * Number of jobs that have not finished yet.
+ */
+int job_count()
+{
+	int count = 0;
+	for (struct job_t *job = jobs.first; job != NULL; job = job->next)
+		if (job->state != JOB_DONE)
+			count++;
+	return count;
+}
+
+/**
+ * Applies a status reported by wait4 to the job owning pid.
+ * @param  pid    process whose state changed
+ * @param  status wait status
+ * @param  usage  resources used by pid, counted once it is done
+ * @return        the job, or NULL if pid does not belong to one
+ */
+struct job_t *job_update(pid_t pid, int status, const struct rusage *usage)
+{
+	for (struct job_t *job = jobs.first; job != NULL; job = job->next)
+	{
+		for (int i = 0; i < job->count; ++i)
+		{
+			struct job_process *process = &job->processes[i];
+			if (process->pid != pid)
+				continue;
+
+			if (WIFSTOPPED(status))
+				process->stopped = true;
+			else if (WIFCONTINUED(status))
+				process->stopped = false;
+			else
+			{
+				process->done = true;
+				process->status = status;
+				usage_add(&job->usage, usage);
+			}
+
+			int state = JOB_DONE;
+			for (int p = 0; p < job->count; ++p)
+			{
+				if (!job->processes[p].done && !job->processes[p].stopped)
+				{
+					state = JOB_RUNNING;
+					break;
+				}
+				if (!job->processes[p].done)
+					state = JOB_STOPPED;
+			}
+			if (state != job->state && job->background)
+				job->notify = true;
+			job->state = state;
+			return job;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Collects every child that changed state without blocking. The signalfd is drained
+ * first; it only becomes readable when a SIGCHLD or SIGWINCH arrived, so a quiet shell
+ * skips waitpid entirely.
+ */
+void job_reap()
+{
+	if (jobs.signalFd >= 0)
+	{
+		struct signalfd_siginfo info[8];
+		bool signaled = false;
+		ssize_t n;
+		while ((n = read(jobs.signalFd, info, sizeof(info))) > 0)
+			for (size_t i = 0; i < n / sizeof(info[0]); ++i)
+			{
+				if (info[i].ssi_signo == SIGWINCH)
+					jobs.resized = true;
+				else
+					signaled = true;
+			}
+		if (!signaled)
+			return;
+	}
+
+	int status;
+	pid_t pid;
+	struct rusage usage;
+	while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0)
+		job_update(pid, status, &usage);
+}
+
+/**
+ * Blocks until the terminal has input or was resized, reaping children that finish
+ * meanwhile.
+ */
+void job_wait_input()
+{
+	if (jobs.epollFd < 0)
+		return;
+
+	while (1)
+	{
+		struct epoll_event events[2];
+		int count = epoll_wait(jobs.epollFd, events, 2, -1);
+		if (count < 0 && errno != EINTR)
+			return;
+
+		bool input = false;
+		for (int i = 0; i < count; ++i)
+		{
+			if (events[i].data.fd == jobs.signalFd)
+				job_reap();
+			else
+				input = true;
+		}
+		if (input || jobs.resized)
+			return;
+	}
+}
+
+/**
+ * Describes the state of a job for jobs and the completion notices.
+ */
+void job_state_text(struct job_t *job, char *out, size_t size)
+{
+	if (job->state == JOB_RUNNING)
+	{
+		snprintf(out, size, "Running");
+		return;
+	}
+	if (job->state == JOB_STOPPED)
+	{
+		snprintf(out, size, "Stopped");
+		return;
+	}
+
+	int status = job->processes[job->count - 1].status;
+	if (WIFSIGNALED(status))
+		snprintf(out, size, "%s%s", strsignal(WTERMSIG(status)), WCOREDUMP(status) ? " (core dumped)" : "");
+	else if (WEXITSTATUS(status) != 0)
+		snprintf(out, size, "Exit %d", WEXITSTATUS(status));
+	else
+		snprintf(out, size, "Done");
+}
+
+/**
+ * Prints one line of the job list.
+ */
+void job_print(struct job_t *job, bool showPids)
+{
+	char state[64];
+	job_state_text(job, state, sizeof(state));
+
+	printf("[%d]%c  ", job->id, job == jobs.current ? '+' : ' ');
+	if (showPids)
+		printf("%d ", job->count > 0 ? job->processes[0].pid : 0);
+	printf("%-24s%s%s\n", state, job->text, job->state == JOB_RUNNING ? " &" : "");
+}
+
+/**
+ * Reports the background jobs that changed state since the last prompt and forgets
+ * the finished ones.
+ */
+void job_notify()
+{
+	job_reap();
+
+	struct job_t *job = jobs.first;
+	while (job != NULL)
+	{
+		struct job_t *next = job->next;
+		if (job->notify)
+		{
+			job->notify = false;
+			job_print(job, false);
+		}
+		if (job->state == JOB_DONE && job->background)
+			job_remove(job);
+		job = next;
+	}
+}
+
+/**
+ * Waits until a job finishes or stops. A foreground job gets the terminal for the
+ * time it runs; a finished job is removed from the table.
+ * @param  job        job to wait for
+ * @param  foreground whether the job gets the terminal
+ * @return            the job's exit status, or 128 + signal number if it stopped
+ */
+int job_wait(struct job_t *job, bool foreground)
+{
+	if (foreground && jobs.control)
+	{
+		tcsetpgrp(STDIN_FILENO, job->pgid);
+		if (job->savedModes)
+			tcsetattr(STDIN_FILENO, TCSADRAIN, &job->modes);
+	}
+
+	long long start = now_ns();
+	while (job->state == JOB_RUNNING)
+	{
+		int status;
+		struct rusage usage;
+		pid_t pid = wait4(-1, &status, WUNTRACED, &usage);
+		if (pid < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break; // ECHILD, nothing left to wait for
+		}
+
+		struct job_t *owner = job_update(pid, status, &usage);
+		// a process that touched the terminal before the shell handed it over stopped on
+		// SIGTTIN/SIGTTOU, let it go on now that its group owns the terminal
+		if (owner == job && foreground && jobs.control && WIFSTOPPED(status) &&
+			(WSTOPSIG(status) == SIGTTIN || WSTOPSIG(status) == SIGTTOU))
+			kill(pid, SIGCONT);
+	}
+
+	stat_record(STAT_WAIT, now_ns() - start);
+
+	if (foreground && jobs.control)
+	{
+		tcsetpgrp(STDIN_FILENO, jobs.shellPgid);
+		job->savedModes = tcgetattr(STDIN_FILENO, &job->modes) == 0;
+		tcsetattr(STDIN_FILENO, TCSADRAIN, &jobs.shellModes);
+	}
+
+	if (job->state == JOB_STOPPED)
+	{
+		job->background = true;
+		job->notify = false;
+		jobs.current = job;
+		printf("\n");
+		job_print(job, false);
+		return 128 + SIGTSTP;
+	}
+
+	int status = job_status(job);
+	usage_add_child(&job->usage);
+	if (foreground && job->count > 0)
+	{
+		int last = job->processes[job->count - 1].status;
+		if (WIFSIGNALED(last) && WTERMSIG(last) == SIGINT)
+			printf("\n"); // the terminal echoed ^C without a newline
+		else if (WIFSIGNALED(last) && WTERMSIG(last) != SIGPIPE)
+			printf("%s%s\n", strsignal(WTERMSIG(last)), WCOREDUMP(last) ? " (core dumped)" : "");
+	}
+	job_remove(job);
+	return status;
+}
+
+/**
+ * Finishes starting a job: a foreground job is waited for, a background job is
+ * announced and left running.
+ * @param job job whose processes were all started
+ */
+void job_launched(struct job_t *job)
+{
+	if (job->count == 0)
+	{
+		job_remove(job);
+		return;
+	}
+	if (!job->background)
+	{
+		last_status = job_wait(job, true);
+		return;
+	}
+
+	jobs.current = job;
+	if (jobs.control)
+		printf("[%d] %d\n", job->id, job->processes[job->count - 1].pid);
+}
+
+/**
+ * Finds the job named by a job spec: %n, %%, %+ or a process id.
+ * @return the job or NULL if there is no such job (already reported)
+ */
+struct job_t *job_from_spec(const char *name, const char *spec)
+{
+	struct job_t *found = NULL;
+
+	if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0)
+		found = jobs.current;
+	else if (spec[0] == '%')
+	{
+		int id = atoi(spec + 1);
+		for (struct job_t *job = jobs.first; job != NULL && found == NULL; job = job->next)
+			if (job->id == id)
+				found = job;
+	}
+	else
+	{
+		pid_t pid = atoi(spec);
+		for (struct job_t *job = jobs.first; job != NULL && found == NULL; job = job->next)
+			for (int i = 0; i < job->count; ++i)
+				if (job->processes[i].pid == pid)
+					found = job;
+	}
+
+	if (found == NULL)
+		printf("-%s: %s: %s: no such job\n", sysname, name, spec ? spec : "current");
+	return found;
+}
+
+/*
+ * Line editor used by the interactive prompt. Keys are read in batches with read(), the
+ * line lives in an edit buffer with a cursor, and every change is drawn as one frame:
+ * the part of the screen that differs from the buffer is rewritten with ANSI cursor
+ * movement and the whole frame goes out in a single write(). Positions on screen are
+ * cells counted from the start of the prefix row, so a line longer than the terminal
+ * wraps onto the following rows.
+ */
+struct line_editor
+{
+	char *buf; // edit buffer, NUL terminated only when a line is returned
+	size_t length;
+	size_t capacity;
+	size_t cursor; // insertion point in buf
+
+	char *shown; // what the terminal currently displays after the prompt
+	size_t shownLength;
+	size_t shownCursor;
+	size_t shownRow; // row of the cursor below the first row of the prefix
+
+	const char *prefix; // prompt or search label in front of the line
+	size_t prefixLength;
+	size_t prefixWidth; // cells the last row of the prefix takes
+	size_t columns;		// terminal width
+
+	char *frame; // escape sequences and text of the frame being assembled
+	size_t frameLength;
+	size_t frameCapacity;
+
+	char keys[512]; // keys read from the terminal but not handled yet
+	size_t keyStart;
+	size_t keyEnd;
+
+	size_t historyPosition; // history entry being shown, history.count for the new line
+	char *draft;			// the new line while browsing history
+	size_t draftLength;
+};
+
+static struct line_editor editor;
+
+/**
+ * Makes sure buf and shown can hold size bytes.
+ */
+void editor_reserve(size_t size)
+{
+	if (size <= editor.capacity)
+		return;
+	while (editor.capacity < size)
+		editor.capacity = editor.capacity ? editor.capacity * 2 : 256;
+	editor.buf = realloc(editor.buf, editor.capacity);
+	editor.shown = realloc(editor.shown, editor.capacity);
+}
+
+/**
+ * Appends raw bytes to the frame being assembled.
+ */
+void editor_frame_append(const char *data, size_t length)
+{
+	if (editor.frameLength + length > editor.frameCapacity)
+	{
+		while (editor.frameLength + length > editor.frameCapacity)
+			editor.frameCapacity = editor.frameCapacity ? editor.frameCapacity * 2 : 1024;
+		editor.frame = realloc(editor.frame, editor.frameCapacity);
+	}
+	memcpy(editor.frame + editor.frameLength, data, length);
+	editor.frameLength += length;
+}
+
+/**
+ * Appends a cursor movement of count cells, 'A' moves up, 'B' down, 'C' right and
+ * 'D' left.
+ */
+void editor_frame_move(size_t count, char direction)
+{
+	char sequence[32];
+	if (count == 0)
+		return;
+	int length = snprintf(sequence, sizeof(sequence), "\x1b[%zu%c", count, direction);
+	editor_frame_append(sequence, length);
+}
+
+/**
+ * Decodes the UTF-8 character at text. A byte that starts no valid sequence is a
+ * character of its own.
+ * @param  code set to the code point
+ * @return      number of bytes of the character
+ */
+size_t editor_decode(const char *text, size_t length, uint32_t *code)
+{
+	unsigned char c = text[0];
+	size_t size = c >= 0xF0 && c < 0xF8 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+	if (c < 0xC0 || c >= 0xF8 || size > length)
+	{
+		*code = c;
+		return 1;
+	}
+	uint32_t value = c & (0x7F >> size);
+	for (size_t i = 1; i < size; ++i)
+	{
+		if (((unsigned char)text[i] & 0xC0) != 0x80)
+		{
+			*code = c;
+			return 1;
+		}
+		value = value << 6 | ((unsigned char)text[i] & 0x3F);
+	}
+	*code = value;
+	return size;
+}
+
+/**
+ * Columns a code point takes: 0 for combining marks and zero width characters, 2 for
+ * the wide East Asian and emoji ranges, 1 for everything else.
+ */
+int editor_char_width(uint32_t code)
+{
+	if ((code >= 0x300 && code <= 0x36F) || (code >= 0x200B && code <= 0x200F) ||
+		(code >= 0x20D0 && code <= 0x20FF) || (code >= 0xFE00 && code <= 0xFE0F))
+		return 0;
+	if ((code >= 0x1100 && code <= 0x115F) || (code >= 0x2E80 && code <= 0xA4CF && code != 0x303F) ||
+		(code >= 0xAC00 && code <= 0xD7A3) || (code >= 0xF900 && code <= 0xFAFF) ||
+		(code >= 0xFE30 && code <= 0xFE4F) || (code >= 0xFF00 && code <= 0xFF60) ||
+		(code >= 0xFFE0 && code <= 0xFFE6) || (code >= 0x1F300 && code <= 0x1F64F) ||
+		(code >= 0x1F900 && code <= 0x1F9FF) || (code >= 0x20000 && code <= 0x3FFFD))
+		return 2;
+	return 1;
+}
+
+/**
+ * Cell the terminal is at after drawing text from cell. Characters take their display
+ * width, a wide one that does not fit in the rest of a row moves to the next row, escape
+ * sequences take nothing and a newline starts over, so a prompt counts only its last row.
+ */
+size_t editor_advance(size_t cell, const char *text, size_t length)
+{
+	for (size_t i = 0; i < length;)
+	{
+		uint32_t code;
+		if (text[i] == 27 && i + 1 < length && text[i + 1] == '[')
+		{
+			for (i += 2; i < length && (text[i] < '@' || text[i] > '~'); ++i)
+				;
+			i++;
+			continue;
+		}
+		i += editor_decode(text + i, length - i, &code);
+		if (code == '\n' || code == '\r')
+			cell = 0;
+		else if (code >= 32)
+		{
+			int width = editor_char_width(code);
+			if (width == 2 && cell % editor.columns == editor.columns - 1)
+				cell++;
+			cell += width;
+		}
+	}
+	return cell;
+}
+
+/**
+ * Cell of a position in the edit buffer or in the shown text.
+ */
+size_t editor_cell(const char *text, size_t position)
+{
+	return editor_advance(editor.prefixWidth, text, position);
+}
+
+/**
+ * Start of the character after the one at position, zero width characters that follow it
+ * included so that the cursor never stops inside what the terminal shows as one cell.
+ */
+size_t editor_next(size_t position)
+{
+	uint32_t code;
+	if (position < editor.length)
+		position += editor_decode(editor.buf + position, editor.length - position, &code);
+	while (position < editor.length)
+	{
+		size_t size = editor_decode(editor.buf + position, editor.length - position, &code);
+		if (editor_char_width(code) != 0 || code < 32)
+			break;
+		position += size;
+	}
+	return position;
+}
+
+/**
+ * Start of the character before position, see editor_next().
+ */
+size_t editor_previous(size_t position)
+{
+	size_t at = 0;
+	while (at < position)
+	{
+		size_t next = editor_next(at);
+		if (next >= position)
+			break;
+		at = next;
+	}
+	return at;
+}
+
+/**
+ * Appends the cursor movement from one cell to another, across wrapped rows.
+ */
+void editor_frame_goto(size_t from, size_t to)
+{
+	size_t columns = editor.columns;
+	if (to / columns < from / columns)
+		editor_frame_move(from / columns - to / columns, 'A');
+	else
+		editor_frame_move(to / columns - from / columns, 'B');
+	if (to % columns < from % columns)
+		editor_frame_move(from % columns - to % columns, 'D');
+	else
+		editor_frame_move(to % columns - from % columns, 'C');
+}
+
+/**
+ * Called after text was just written up to cell end. A row filled to the last column leaves
+ * the terminal waiting to wrap with the cursor still on that row; moving to the next
+ * row makes the cursor agree with end.
+ */
+void editor_frame_wrap(size_t end)
+{
+	if (end > 0 && end % editor.columns == 0)
+		editor_frame_append("\r\n", 2);
+}
+
+/**
+ * Reads the terminal width, 80 columns when it cannot be told.
+ */
+void editor_update_columns()
+{
+	struct winsize size;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0)
+		editor.columns = size.ws_col;
+	else
+		editor.columns = 80;
+}
+
+/**
+ * Sends the assembled frame with a single write.
+ */
+void editor_frame_flush()
+{
+	size_t written = 0;
+	while (written < editor.frameLength)
+	{
+		ssize_t n = write(STDOUT_FILENO, editor.frame + written, editor.frameLength - written);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		written += n;
+	}
+	editor.frameLength = 0;
+}
+
+/**
+ * Brings the terminal in sync with the edit buffer. Only the text after the first
+ * difference is rewritten; pure cursor movement costs one escape sequence.
+ */
+void editor_refresh()
+{
+	size_t same = 0;
+	while (same < editor.shownLength && same < editor.length && editor.shown[same] == editor.buf[same])
+		same++;
+	// rewrite whole characters, not the tail of one
+	while (same > 0 && same < editor.length && ((unsigned char)editor.buf[same] & 0xC0) == 0x80)
+		same--;
+
+	size_t shownAt = editor_cell(editor.shown, editor.shownCursor);
+	size_t cursorAt = editor_cell(editor.buf, editor.cursor);
+
+	if (same == editor.length && same == editor.shownLength)
+	{
+		// text unchanged, only move the cursor
+		editor_frame_goto(shownAt, cursorAt);
+	}
+	else
+	{
+		size_t sameAt = editor_cell(editor.buf, same);
+		size_t end = editor_advance(sameAt, editor.buf + same, editor.length - same);
+		editor_frame_goto(shownAt, sameAt);
+
+		editor_frame_append(editor.buf + same, editor.length - same);
+		if (editor.length > same)
+			editor_frame_wrap(end);
+		if (end < editor_cell(editor.shown, editor.shownLength))
+			editor_frame_append("\x1b[J", 3); // clear the leftovers of a longer line
+		editor_frame_goto(end, cursorAt);
+
+		memcpy(editor.shown + same, editor.buf + same, editor.length - same);
+		editor.shownLength = editor.length;
+	}
+	editor.shownCursor = editor.cursor;
+	editor.shownRow = cursorAt / editor.columns;
+	editor_frame_flush();
+}
+
+/**
+ * Redraws the whole line with a different text in front of the edit buffer, used when
+ * switching between the prompt and the reverse search label and after a resize. Rows
+ * of a multi-line prompt above the last one stay as they are.
+ */
+void editor_redraw(const char *prefix, size_t prefixLength)
+{
+	editor.prefix = prefix;
+	editor.prefixLength = prefixLength;
+	editor.prefixWidth = editor_advance(0, prefix, prefixLength);
+	const char *lastRow = memrchr(prefix, '\n', prefixLength);
+	lastRow = lastRow != NULL ? lastRow + 1 : prefix;
+
+	editor_frame_move(editor.shownRow, 'A');
+	editor_frame_append("\r", 1);
+	editor_frame_append(lastRow, prefix + prefixLength - lastRow);
+	editor_frame_append(editor.buf, editor.length);
+	size_t end = editor_cell(editor.buf, editor.length);
+	size_t cursorAt = editor_cell(editor.buf, editor.cursor);
+	editor_frame_wrap(end);
+	editor_frame_append("\x1b[J", 3);
+	editor_frame_goto(end, cursorAt);
+
+	memcpy(editor.shown, editor.buf, editor.length);
+	editor.shownLength = editor.length;
+	editor.shownCursor = editor.cursor;
+	editor.shownRow = cursorAt / editor.columns;
+	editor_frame_flush();
+}
+
+/**
+ * Returns the next key byte, reading a new batch from the terminal when needed.
+ * @return the byte or -1 on end of input
+ */
+int editor_read_key()
+{
+	while (editor.keyStart == editor.keyEnd)
+	{
+		job_wait_input();
+		if (jobs.resized)
+		{
+			// the shown line is only ever behind when no keys are pending
+			jobs.resized = false;
+			editor_update_columns();
+			editor_redraw(editor.prefix, editor.prefixLength);
+			continue;
+		}
+		ssize_t n = read(STDIN_FILENO, editor.keys, sizeof(editor.keys));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		editor.keyStart = 0;
+		editor.keyEnd = n;
+	}
+	return (unsigned char)editor.keys[editor.keyStart++];
+}
+
+/**
+ * Replaces the edit buffer with text and puts the cursor at its end.
+ */
+void editor_set_line(const char *text, size_t length)
+{
+	editor_reserve(length + 1);
+	memcpy(editor.buf, text, length);
+	editor.length = editor.cursor = length;
+}
+
+/**
+ * Inserts one byte at the cursor.
+ */
+void editor_insert(char c)
+{
+	editor_reserve(editor.length + 2);
+	memmove(editor.buf + editor.cursor + 1, editor.buf + editor.cursor, editor.length - editor.cursor);
+	editor.buf[editor.cursor++] = c;
+	editor.length++;
+}
+
+/**
+ * Deletes count bytes starting at position.
+ */
+void editor_delete(size_t position, size_t count)
+{
+	if (position + count > editor.length)
+		count = editor.length - position;
+	memmove(editor.buf + position, editor.buf + position + count, editor.length - position - count);
+	editor.length -= count;
+	if (editor.cursor > position + count)
+		editor.cursor -= count;
+	else if (editor.cursor > position)
+		editor.cursor = position;
+}
+
+// editing keys that arrive as escape sequences, numbered above any byte value
+enum editor_keys
+{
+	KEY_UP = 1000,
+	KEY_DOWN,
+	KEY_RIGHT,
+	KEY_LEFT,
+	KEY_HOME,
+	KEY_END,
+	KEY_DELETE,
+};
+
+/**
+ * Decodes the rest of an escape sequence after ESC.
+ * @return one of the KEY_* codes or 0 for sequences that are ignored
+ */
+int editor_read_escape()
+{
+	int c = editor_read_key();
+	if (c != '[' && c != 'O')
+		return 0;
+
+	c = editor_read_key();
+	if (c >= '0' && c <= '9')
+	{
+		int number = c - '0';
+		while ((c = editor_read_key()) >= '0' && c <= '9')
+			number = number * 10 + c - '0';
+		if (c != '~')
+			return 0;
+		switch (number)
+		{
+		case 1:
+		case 7:
+			return KEY_HOME;
+		case 4:
+		case 8:
+			return KEY_END;
+		case 3:
+			return KEY_DELETE;
+		}
+		return 0;
+	}
+
+	switch (c)
+	{
+	case 'A':
+		return KEY_UP;
+	case 'B':
+		return KEY_DOWN;
+	case 'C':
+		return KEY_RIGHT;
+	case 'D':
+		return KEY_LEFT;
+	case 'H':
+		return KEY_HOME;
+	case 'F':
+		return KEY_END;
+	}
+	return 0;
+}
+
+/**
+ * Shows history entry position, or the draft when position is past the last entry.
+ */
+void editor_show_history(size_t position)
+{
+	if (editor.historyPosition == history.count)
+	{
+		// leaving the new line, keep it to come back to
+		editor.draft = realloc(editor.draft, editor.length + 1);
+		memcpy(editor.draft, editor.buf, editor.length);
+		editor.draftLength = editor.length;
+	}
+	editor.historyPosition = position;
+	if (position == history.count)
+		editor_set_line(editor.draft, editor.draftLength);
+	else
+		editor_set_line(history.entries[position].text, history.entries[position].length);
+}
+
+/**
+ * Ctrl+R, incremental reverse search through the history. Typed characters extend the
+ * query, Ctrl+R moves to the next older match, backspace shortens the query and Ctrl+G
+ * gives up and restores the line. Any other key accepts the match in the edit buffer.
+ * @param  prompt       prompt to restore after the search
+ * @param  promptLength length of prompt
+ * @return              the key that ended the search, to be handled by the caller
+ */
+int editor_reverse_search(const char *prompt, size_t promptLength)
+{
+	history_load();
+
+	char query[256];
+	size_t queryLength = 0;
+	size_t match = history.count; // entry shown in the buffer
+	bool failed = false;
+
+	char *original = malloc(editor.length + 1);
+	size_t originalLength = editor.length, originalCursor = editor.cursor;
+	memcpy(original, editor.buf, editor.length);
+
+	int c;
+	while (1)
+	{
+		if (editor.keyStart == editor.keyEnd)
+		{
+			char label[320];
+			int labelLength = snprintf(label, sizeof(label), "(%sreverse-i-search)`%.*s': ",
+									   failed ? "failed " : "", (int)queryLength, query);
+			editor_redraw(label, labelLength);
+		}
+
+		c = editor_read_key();
+		if (c == 27)
+			c = editor_read_escape();
+
+		size_t before;
+		if (c == 18) // Ctrl+R, older match
+			before = match;
+		else if ((c == 127 || c == 8) && queryLength > 0)
+		{
+			queryLength--;
+			before = history.count;
+		}
+		else if (c >= 32 && c < 256 && c != 127)
+		{
+			if (queryLength == sizeof(query))
+				continue;
+			query[queryLength++] = c;
+			before = match < history.count ? match + 1 : history.count; // the shown match may still fit
+		}
+		else
+			break;
+
+		long found = history_search(query, queryLength, before);
+		failed = found < 0;
+		if (!failed)
+		{
+			match = found;
+			const struct history_entry *entry = &history.entries[match];
+			editor_set_line(entry->text, entry->length);
+			const char *at = memmem(entry->text, entry->length, query, queryLength);
+			editor.cursor = at ? at - entry->text : entry->length;
+		}
+	}
+
+	if (c == 7) // Ctrl+G
+	{
+		editor_set_line(original, originalLength);
+		editor.cursor = originalCursor;
+		c = 0;
+	}
+	free(original);
+	editor.historyPosition = history.count;
+	editor_redraw(prompt, promptLength);
+	return c;
+}
+
+/**
+ * Reads one line from the terminal in raw mode.
+ * @param  prompt       text drawn in front of the line
+ * @param  promptLength length of prompt
+ * @return              SUCCESS with the NUL terminated line in editor.buf, or EXIT on
+ *                      Ctrl+D on an empty line and end of input
+ */
+int editor_read_line(const char *prompt, size_t promptLength)
+{
+	// tcgetattr gets the parameters of the current terminal
+	// STDIN_FILENO will tell tcgetattr that it should write the settings
+	// of stdin to oldt
+	long long start = now_ns();
+	static struct termios backup_termios, new_termios;
+	tcgetattr(STDIN_FILENO, &backup_termios);
+	new_termios = backup_termios;
+	// ICANON normally takes care that one line at a time will be processed
+	// that means it will return if it sees a "\n" or an EOF or an EOL
+	new_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo, frames are drawn by the editor.
+	new_termios.c_lflag &= ~ISIG;			 // Ctrl+C, Ctrl+Z and Ctrl+\ arrive as keys while editing
+	new_termios.c_cc[VMIN] = 1;
+	new_termios.c_cc[VTIME] = 0;
+	// Those new settings will be set to STDIN
+	// TCSANOW tells tcsetattr to change attributes immediately.
+	tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+
+	fflush(stdout); // output of the last command goes out before the prompt
+
+	editor_reserve(1);
+	editor.length = editor.cursor = 0;
+	editor.shownLength = editor.shownCursor = 0;
+	editor.historyPosition = history.count;
+	editor_update_columns();
+	jobs.resized = false;
+	editor.prefix = prompt;
+	editor.prefixLength = promptLength;
+	editor.prefixWidth = editor_advance(0, prompt, promptLength);
+	editor.shownRow = editor.prefixWidth / editor.columns;
+	editor_frame_append(prompt, promptLength);
+	editor_frame_wrap(editor.prefixWidth);
+	editor_frame_flush();
+	stat_record(STAT_PROMPT, now_ns() - start);
+
+	int code = SUCCESS;
+	bool done = false;
+	bool cancelled = false;
+	int pending = 0; // key that ended a reverse search
+
+	while (!done)
+	{
+		int c = pending;
+		pending = 0;
+		if (c == 0)
+		{
+			c = editor_read_key();
+			// printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
+
+			if (c == 27)
+				c = editor_read_escape();
+		}
+
+		switch (c)
+		{
+		case -1: // end of input
+			code = EXIT;
+			done = true;
+			break;
+		case '\r':
+		case '\n': // enter key
+			done = true;
+			break;
+		case 3: // Ctrl+C, drop the line
+			cancelled = done = true;
+			break;
+		case 4: // Ctrl+D
+			if (editor.length == 0)
+			{
+				code = EXIT;
+				done = true;
+			}
+			else
+				editor_delete(editor.cursor, editor_next(editor.cursor) - editor.cursor);
+			break;
+		case 9: // tab, autocomplete
+			editor.cursor = editor.length;
+			editor_insert('?');
+			done = true;
+			break;
+		case 127: // backspace
+		case 8:
+			if (editor.cursor > 0)
+			{
+				size_t previous = editor_previous(editor.cursor);
+				editor_delete(previous, editor.cursor - previous);
+			}
+			break;
+		case KEY_DELETE:
+			editor_delete(editor.cursor, editor_next(editor.cursor) - editor.cursor);
+			break;
+		case KEY_LEFT:
+		case 2: // Ctrl+B
+			editor.cursor = editor_previous(editor.cursor);
+			break;
+		case KEY_RIGHT:
+		case 6: // Ctrl+F
+			editor.cursor = editor_next(editor.cursor);
+			break;
+		case KEY_HOME:
+		case 1: // Ctrl+A
+			editor.cursor = 0;
+			break;
+		case KEY_END:
+		case 5: // Ctrl+E
+			editor.cursor = editor.length;
+			break;
+		case 11: // Ctrl+K, kill to the end of the line
+			editor_delete(editor.cursor, editor.length - editor.cursor);
+			break;
+		case 21: // Ctrl+U, kill to the start of the line
+			editor_delete(0, editor.cursor);
+			break;
+		case KEY_UP:
+		case 16: // Ctrl+P
+			if (!history.loaded)
+			{
+				history_load();
+				editor.historyPosition = history.count;
+			}
+			if (editor.historyPosition > 0)
+				editor_show_history(editor.historyPosition - 1);
+			break;
+		case KEY_DOWN:
+		case 14: // Ctrl+N
+			if (editor.historyPosition < history.count)
+				editor_show_history(editor.historyPosition + 1);
+			break;
+		case 18: // Ctrl+R
+			pending = editor_reverse_search(prompt, promptLength);
+			break;
+		default:
+			if (c >= 32 && c < 256)
+				editor_insert(c);
+			break;
+		}
+
+		// draw once per batch of keys instead of once per key
+		if (!done && editor.keyStart == editor.keyEnd)
+			editor_refresh();
+	}
+
+	if (code == SUCCESS)
+	{
+		editor.cursor = editor.length;
+		editor_refresh();
+		if (cancelled)
+		{
+			editor_frame_append("^C", 2);
+			editor.length = 0;
+		}
+		editor_frame_append("\n", 1);
+		editor_frame_flush();
+	}
+
+	// restore the old settings
+	tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+	editor.buf[editor.length] = 0;
+	return code;
+}
+
+/**
+ * Prompt a command from the user
+ * @return SUCCESS with the entered line in editor.buf, or EXIT on Ctrl+D or end of input
+ */
+int prompt()
+{
+	char promptText[4096];
+	int promptLength = show_prompt(promptText, sizeof(promptText));
+
+	if (editor_read_line(promptText, promptLength) == EXIT)
+		return EXIT;
+
+	history_add(editor.buf, editor.length);
+	return SUCCESS;
+}
+
+int process_command(struct command_t *command);
+int run_job(struct command_t *command, int fds[3]);
+int run_redirect_only(int fds[3]);
+int open_redirects(struct command_t *command, int fds[3]);
+void close_redirects(int fds[3]);
+ssize_t copy_fd(int in, int out);
+pid_t start_external(struct command_t *command, int fds[3], pid_t pgid);
+int run_pipeline(struct command_t *command);
+int spawn_benchmark(int iterations);
+int startup_benchmark(int iterations);
+int execute_line(char *line);
+int run_script_file(const char *path);
+int run_stream(int fd);
+
+enum matcher_flags
+{
+	MATCH_GLOB = 1,		   // -g, a shell pattern for the whole name
+	MATCH_REGEX = 2,	   // -e, an extended regular expression
+	MATCH_IGNORE_CASE = 4  // -i
+};
+
+struct matcher
+{
+	int flags;
+	const char *pattern;
+	char *folded; // pattern in lower case, for MATCH_IGNORE_CASE substrings
+	size_t length;
+	regex_t regex;
+};
+
+bool matcher_init(struct matcher *matcher, const char *pattern, int flags, char *error, size_t errorSize);
+bool matcher_match(const struct matcher *matcher, const char *name);
+void matcher_free(struct matcher *matcher);
+void recursiveFileSearch(const struct matcher *matcher, bool open, bool sorted, int threads);
+void filesearch_print(char **lines, size_t count, bool open, bool sorted);
+bool index_search(const struct matcher *matcher, bool open, bool sorted);
+int index_command(struct command_t *command);
+
+/*
+ * Directory traversal engine used by filesearch, create and the filesearch -r walker.
+ * Directories are read with getdents64 into a large buffer and subdirectories are
+ * opened with openat relative to their parent, so no path is resolved twice; the
+ * relative path is kept in one buffer that grows and shrinks by a component per level
+ * and is only used for printing. fstatat is called only when d_type is DT_UNKNOWN.
+ * The directories being read are kept on a heap allocated stack, one frame each. When
+ * the process runs out of descriptors the shallowest open ancestors are closed and
+ * reopened by path, at the offset they were read to, once the walk returns to them.
+ * Directories that cannot be opened are reported on stderr and counted in errors.
+ */
+enum traverse_result
+{
+	TRAVERSE_CONTINUE, // descend into the entry if it is a directory
+	TRAVERSE_SKIP,	   // do not descend into it
+	TRAVERSE_STOP	   // end the traversal
+};
+
+struct traverse_frame
+{
+	int fd;
+	char *buffer; // getdents64 records
+	long length;
+	long position;
+	size_t pathLength; // length of traversal.path for this directory
+	off_t offset;	   // read position, saved when fd is closed to free a descriptor
+};
+
+struct traversal
+{
+	// set by the caller
+	enum traverse_result (*visit)(struct traversal *walk, const char *name, unsigned char type);
+	void *data;
+	int maxDepth; // 1 reads only the start directory, 0 for no limit
+	int errors;	  // directories that could not be opened, added up over calls
+	// set while visit runs
+	int dirfd; // the directory of the entry
+	int depth; // 0 for entries of the start directory
+	char *path; // relative path of the directory, empty or ending in '/'
+	size_t pathCapacity;
+	struct traverse_frame *frames;
+	int frameCount;
+	int frameCapacity;
+	int rootfd; // the dirfd passed to traverse, for reopening
+};
+
+int traverse(struct traversal *walk, int dirfd, const char *path);
+void traverse_free(struct traversal *walk);
+
+//Builtin command handlers. Each runs inside the shell process and returns SUCCESS or EXIT.
+int builtin_exit(struct command_t *command);
+int builtin_cd(struct command_t *command);
+int builtin_cdh(struct command_t *command);
+int builtin_joker(struct command_t *command);
+int builtin_pstraverse(struct command_t *command);
+int builtin_penguinsays(struct command_t *command);
+int builtin_filesearch(struct command_t *command);
+int builtin_take(struct command_t *command);
+int builtin_create(struct command_t *command);
+int builtin_hash(struct command_t *command);
+int builtin_launcher(struct command_t *command);
+int builtin_jobs(struct command_t *command);
+int builtin_fg(struct command_t *command);
+int builtin_bg(struct command_t *command);
+int builtin_wait(struct command_t *command);
+int builtin_parallel(struct command_t *command);
+int builtin_true(struct command_t *command);
+int builtin_shellstats(struct command_t *command);
+int builtin_z(struct command_t *command);
+
+struct builtin_t
+{
+	const char *name;
+	int (*handler)(struct command_t *command);
+	bool forkable; // may run in a child process when started with '&'
+};
+
+/*
+ * Builtins that change the shell state (cwd, loaded driver) are never forked, even in the
+ * background, otherwise the change would be lost together with the child.
+ */
+static const struct builtin_t builtins[] =
+{
+	{"exit", builtin_exit, false},
+	{":", builtin_true, false},
+	{"cd", builtin_cd, false},
+	{"cdh", builtin_cdh, false},
+	{"take", builtin_take, false},
+	{"pstraverse", builtin_pstraverse, false},
+	{"joker", builtin_joker, true},
+	{"penguinsays", builtin_penguinsays, true},
+	{"filesearch", builtin_filesearch, true},
+	{"create", builtin_create, true},
+	{"hash", builtin_hash, false},
+	{"launcher", builtin_launcher, false},
+	{"jobs", builtin_jobs, false},
+	{"fg", builtin_fg, false},
+	{"bg", builtin_bg, false},
+	{"wait", builtin_wait, false},
+	{"parallel", builtin_parallel, true},
+	{"shellstats", builtin_shellstats, false},
+	{"z", builtin_z, false},
+};
+
+int run_builtin(const struct builtin_t *builtin, struct command_t *command, int fds[3]);
+
+#define BUILTIN_COUNT (sizeof(builtins) / sizeof(builtins[0]))
+#define BUILTIN_TABLE_SIZE 64 // power of two, kept well above BUILTIN_COUNT
+
+static const struct builtin_t *builtin_table[BUILTIN_TABLE_SIZE];
+static bool builtin_table_ready = false;
+
+/**
+ * FNV-1a hash of a NUL terminated string.
+ * @param  str string to be hashed
+ * @return     32 bit hash value
+ */
+unsigned int hash_string(const char *str)
+{
+	unsigned int hash = 2166136261u;
+	while (*str)
+	{
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * Fills the open addressing builtin table from the builtins array.
+ */
+void builtin_table_init()
+{
+	for (int i = 0; i < BUILTIN_COUNT; ++i)
+	{
+		unsigned int index = hash_string(builtins[i].name) & (BUILTIN_TABLE_SIZE - 1);
+		while (builtin_table[index] != NULL)
+			index = (index + 1) & (BUILTIN_TABLE_SIZE - 1);
+		builtin_table[index] = &builtins[i];
+	}
+	builtin_table_ready = true;
+}
+
+/**
+ * Looks up a builtin by name.
+ * @param  name command name
+ * @return      the builtin entry or NULL if name is not a builtin
+ */
+const struct builtin_t *find_builtin(const char *name)
+{
+	if (!builtin_table_ready)
+		builtin_table_init();
+
+	unsigned int index = hash_string(name) & (BUILTIN_TABLE_SIZE - 1);
+	while (builtin_table[index] != NULL)
+	{
+		if (strcmp(builtin_table[index]->name, name) == 0)
+			return builtin_table[index];
+		index = (index + 1) & (BUILTIN_TABLE_SIZE - 1);
+	}
+	return NULL;
+}
+
+struct path_cache_entry
+{
+	char *name;
+	char *path;
+	unsigned int hits;
+	struct path_cache_entry *next;
+};
+
+#define PATH_CACHE_BUCKETS 128 // power of two
+
+// command name -> absolute path, filled lazily like bash's hash table.
+static struct path_cache_entry *path_cache[PATH_CACHE_BUCKETS];
+// the PATH value the cache was built from, used to detect PATH changes.
+static char *path_cache_env = NULL;
+
+/**
+ * Drops every entry of the PATH lookup cache.
+ */
+void path_cache_clear()
+{
+	for (int i = 0; i < PATH_CACHE_BUCKETS; ++i)
+	{
+		struct path_cache_entry *entry = path_cache[i];
+		while (entry != NULL)
+		{
+			struct path_cache_entry *next = entry->next;
+			free(entry->name);
+			free(entry->path);
+			free(entry);
+			entry = next;
+		}
+		path_cache[i] = NULL;
+	}
+}
+
+/**
+ * Invalidates the cache if PATH changed since it was built.
+ */
+void path_cache_check_env()
+{
+	const char *env = getenv("PATH");
+	if (env == NULL)
+		env = "";
+	if (path_cache_env != NULL && strcmp(path_cache_env, env) == 0)
+		return;
+	path_cache_clear();
+	free(path_cache_env);
+	path_cache_env = strdup(env);
+}
+
+/**
+ * Removes a single command from the cache, used when its cached path went stale.
+ * @param name command name
+ */
+void path_cache_remove(const char *name)
+{
+	struct path_cache_entry **link = &path_cache[hash_string(name) & (PATH_CACHE_BUCKETS - 1)];
+	while (*link != NULL)
+	{
+		if (strcmp((*link)->name, name) == 0)
+		{
+			struct path_cache_entry *entry = *link;
+			*link = entry->next;
+			free(entry->name);
+			free(entry->path);
+			free(entry);
+			return;
+		}
+		link = &(*link)->next;
+	}
+}
+
+/**
+ * Walks PATH and returns the first executable regular file called name.
+ * @param  name command name, must not contain '/'
+ * @return      malloc'ed absolute path or NULL if not found
+ */
+char *path_search(const char *name)
+{
+	const char *dir = path_cache_env;
+	size_t nameLength = strlen(name);
+
+	while (dir != NULL && *dir != '\0')
+	{
+		const char *end = strchr(dir, ':');
+		size_t dirLength = end ? (size_t)(end - dir) : strlen(dir);
+		char *candidate = malloc(dirLength + nameLength + 3);
+		struct stat stats;
+
+		if (dirLength == 0) // empty PATH element means the current directory
+			strcpy(candidate, ".");
+		else
+		{
+			memcpy(candidate, dir, dirLength);
+			candidate[dirLength] = '\0';
+		}
+		strcat(candidate, "/");
+		strcat(candidate, name);
+
+		if (stat(candidate, &stats) == 0 && S_ISREG(stats.st_mode) && access(candidate, X_OK) == 0)
+			return candidate;
+		free(candidate);
+		dir = end ? end + 1 : NULL;
+	}
+	return NULL;
+}
+
+/**
+ * Resolves a command name to an absolute path through the cache.
+ * @param  name command name, must not contain '/'
+ * @return      cached path (owned by the cache) or NULL if the command is not in PATH
+ */
+const char *path_cache_lookup(const char *name)
+{
+	path_cache_check_env();
+
+	unsigned int bucket = hash_string(name) & (PATH_CACHE_BUCKETS - 1);
+	for (struct path_cache_entry *entry = path_cache[bucket]; entry != NULL; entry = entry->next)
+	{
+		if (strcmp(entry->name, name) == 0)
+		{
+			entry->hits++;
+			return entry->path;
+		}
+	}
+
+	char *path = path_search(name);
+	if (path == NULL)
+		return NULL;
+
+	struct path_cache_entry *entry = malloc(sizeof(struct path_cache_entry));
+	entry->name = strdup(name);
+	entry->path = path;
+	entry->hits = 1;
+	entry->next = path_cache[bucket];
+	path_cache[bucket] = entry;
+	return entry->path;
+}
+
+enum launch_modes
+{
+	LAUNCH_SPAWN = 0, // posix_spawn, glibc implements it with clone(CLONE_VM | CLONE_VFORK)
+	LAUNCH_FORK = 1,  // classic fork + execv
+};
+
+static int launch_mode = LAUNCH_SPAWN;
+static const char *launch_mode_names[] = {"spawn", "fork"};
+
+/**
+ * Starts an external program with the current launch mode.
+ * @param  path  absolute or relative path of the executable
+ * @param  argv  NULL terminated argument vector
+ * @param  fds   descriptors to install as stdin, stdout and stderr, -1 keeps the shell's own
+ * @param  pgid  process group to join, 0 for a new one, -1 to stay in the shell's
+ * @param  error set to the errno value when the program could not be started
+ * @return       pid of the child or -1 on failure
+ */
+pid_t launch_program(const char *path, char **argv, int fds[3], pid_t pgid, int *error)
+{
+	extern char **environ;
+	pid_t pid;
+	long long start = now_ns();
+
+	if (launch_mode == LAUNCH_SPAWN)
+	{
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		// also when fds[i] == i: a close-on-exec redirect that landed on 0-2 (one of them
+		// was closed) must survive the exec, and glibc clears FD_CLOEXEC for a same-fd dup2
+		for (int i = 0; i < 3; ++i)
+			if (fds != NULL && fds[i] >= 0)
+				posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+
+		// the program starts with no blocked signals and the job control signals at default
+		posix_spawnattr_t attributes;
+		posix_spawnattr_init(&attributes);
+		short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+		sigset_t none, defaults;
+		sigemptyset(&none);
+		sigemptyset(&defaults);
+		sigaddset(&defaults, SIGCHLD);
+		for (size_t i = 0; i < sizeof(job_control_signals) / sizeof(job_control_signals[0]); ++i)
+			sigaddset(&defaults, job_control_signals[i]);
+		posix_spawnattr_setsigmask(&attributes, &none);
+		posix_spawnattr_setsigdefault(&attributes, &defaults);
+		if (pgid >= 0)
+		{
+			flags |= POSIX_SPAWN_SETPGROUP;
+			posix_spawnattr_setpgroup(&attributes, pgid);
+		}
+		posix_spawnattr_setflags(&attributes, flags);
+
+		*error = posix_spawn(&pid, path, &actions, &attributes, argv, environ);
+		posix_spawnattr_destroy(&attributes);
+		posix_spawn_file_actions_destroy(&actions);
+		// posix_spawn returns once the child has exec'd, so this covers the exec as well
+		stat_record(STAT_SPAWN, now_ns() - start);
+		return *error == 0 ? pid : -1;
+	}
+
+	// the child reports a failed execv over a close-on-exec pipe
+	int errorPipe[2];
+	if (pipe2(errorPipe, O_CLOEXEC) < 0)
+	{
+		*error = errno;
+		return -1;
+	}
+
+	pid = fork();
+
+	if (pid == 0){ // child
+		job_child_init(pgid);
+		for (int i = 0; i < 3; ++i)
+			if (fds != NULL && fds[i] == i)
+				fcntl(i, F_SETFD, 0); // dup2 onto itself would keep close-on-exec
+			else if (fds != NULL && fds[i] >= 0)
+				dup2(fds[i], i);
+		execv(path, argv);
+		int childError = errno;
+		write(errorPipe[1], &childError, sizeof(childError));
+		_exit(127);
+	}
+
+	close(errorPipe[1]);
+
+	if (pid < 0)
+	{
+		*error = errno;
+		close(errorPipe[0]);
+		return -1;
+	}
+
+	// the pipe reaches EOF as soon as execv succeeds
+	long long forked = now_ns();
+	int childError = 0;
+	ssize_t nbytes = read(errorPipe[0], &childError, sizeof(childError));
+	close(errorPipe[0]);
+	long long execed = now_ns();
+	stat_record(STAT_EXEC, execed - forked);
+	stat_record(STAT_SPAWN, execed - start);
+
+	if (nbytes == sizeof(childError))
+	{
+		waitpid(pid, NULL, 0);
+		*error = childError;
+		return -1;
+	}
+	*error = 0;
+	return pid;
+}
+
+/**
+ * Parses and runs a single line, typed at the prompt or read from a script.
+ * @param  line NUL terminated line, tokenized in place, NULL if it could not be copied
+ * @return      the return code of process_command()
+ */
+int execute_line(char *line)
+{
+	struct command_t *command = arena_zalloc(&line_arena, sizeof(struct command_t));
+	int code = SUCCESS;
+
+	job_reap();
+	long long start = now_ns();
+	int parsed = line != NULL && command != NULL ? parse_command(line, command) : -1;
+	stat_record(STAT_PARSE, now_ns() - start);
+
+	if (parsed == 0)
+		code = process_command(command);
+	else
+		last_status = line_arena.failed ? 1 : 2; // out of memory or a syntax error
+
+	arena_reset(&line_arena);
+	return code;
+}
+
+/**
+ * Runs every line of a writable buffer. Lines are cut in place by replacing the newline
+ * with a NUL, so the parser works directly on the buffer. Only a last line without a
+ * trailing newline is copied, since there may be no byte left to terminate it.
+ * @param  buf    buffer holding the script
+ * @param  length number of bytes in buf
+ * @param  final  whether a trailing line without newline is complete
+ * @param  done   set to true once exit ran
+ * @return        number of bytes consumed
+ */
+size_t run_lines(char *buf, size_t length, bool final, bool *done)
+{
+	size_t offset = 0;
+
+	while (offset < length && !*done)
+	{
+		char *line = buf + offset;
+		char *end = memchr(line, '\n', length - offset);
+
+		if (end == NULL)
+		{
+			if (!final)
+				break;
+			line = arena_strndup(&line_arena, line, length - offset);
+			offset = length;
+		}
+		else
+		{
+			*end = 0;
+			offset = end - buf + 1;
+		}
+
+		if (execute_line(line) == EXIT)
+			*done = true;
+	}
+	return offset;
+}
+
+/**
+ * Runs a script file. The file is mapped privately, so cutting lines in place only
+ * copies the touched pages and never writes back to the file.
+ * @param  path script to run
+ * @return      exit status of the shell
+ */
+int run_script_file(const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat stats;
+	bool done = false;
+
+	if (fd < 0 || fstat(fd, &stats) < 0)
+	{
+		printf("%s: %s: %s\n", sysname, path, strerror(errno));
+		return 127;
+	}
+
+	if (!S_ISREG(stats.st_mode))
+	{
+		// pipes and devices cannot be mapped, stream them instead
+		int status = run_stream(fd);
+		close(fd);
+		return status;
+	}
+
+	if (stats.st_size > 0)
+	{
+		char *buf = mmap(NULL, stats.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (buf == MAP_FAILED)
+		{
+			printf("%s: %s: %s\n", sysname, path, strerror(errno));
+			close(fd);
+			return 126;
+		}
+		madvise(buf, stats.st_size, MADV_SEQUENTIAL);
+		close(fd);
+
+		run_lines(buf, stats.st_size, true, &done);
+		munmap(buf, stats.st_size);
+	}
+	else
+		close(fd);
+
+	return last_status;
+}
+
+/**
+ * Runs commands read from a descriptor that is not a terminal. The commands share it as
+ * stdin and may read on after their own line, so the shell never holds back input past
+ * the line being run: a seekable input is read in large blocks with pread and its offset
+ * is put right behind each line before that line runs, anything else is read one byte
+ * at a time up to the newline. Lines have no length limit.
+ * @param  fd descriptor to read commands from
+ * @return    exit status of the shell
+ */
+int run_stream(int fd)
+{
+	size_t capacity = 64 * 1024, length = 0;
+	char *buf = malloc(capacity);
+	bool done = false;
+	off_t start = lseek(fd, 0, SEEK_CUR); // offset of buf[0] when seekable
+	bool seekable = start >= 0;
+
+	if (fd == STDIN_FILENO)
+		setvbuf(stdin, NULL, _IONBF, 0); // builtins reading stdin take no more than they use
+
+	while (!done)
+	{
+		if (length == capacity)
+		{
+			capacity *= 2;
+			buf = realloc(buf, capacity);
+		}
+
+		ssize_t nbytes = seekable ? pread(fd, buf + length, capacity - length, start + length)
+								  : read(fd, buf + length, 1);
+		if (nbytes < 0 && errno == EINTR)
+			continue;
+		bool final = nbytes <= 0; // the rest is the last line, even without a newline
+		if (!final)
+			length += nbytes;
+		if (!final && !seekable && buf[length - 1] != '\n')
+			continue;
+
+		size_t offset = 0;
+		bool moved = false;
+		while (offset < length && !done)
+		{
+			char *line = buf + offset;
+			char *end = memchr(line, '\n', length - offset);
+			if (end == NULL && !final)
+				break;
+			size_t next = end != NULL ? (size_t)(end - buf) + 1 : length;
+			if (end != NULL)
+				*end = 0;
+			else
+				line = arena_strndup(&line_arena, line, length - offset);
+			offset = next;
+
+			if (seekable)
+				lseek(fd, start + next, SEEK_SET);
+			if (execute_line(line) == EXIT)
+				done = true;
+
+			off_t now = seekable ? lseek(fd, 0, SEEK_CUR) : -1;
+			if (now >= 0 && now != start + (off_t)next)
+			{
+				// a command read on (or seeked back), the next line starts where it stopped
+				start = now;
+				offset = length = 0;
+				moved = true;
+				break;
+			}
+		}
+		if (final && !moved)
+			break;
+		memmove(buf, buf + offset, length - offset);
+		length -= offset;
+		if (seekable)
+			start += offset;
+	}
+	free(buf);
+	return last_status;
+}
+
+#if defined(SHELLFYRE_PARSER_BENCH)
+/*
+ * Parser microbenchmark, built with `make parser_bench`. Every corpus line is copied into
+ * the arena (tokenize() works in place), parsed and released again, which is exactly the
+ * per-line work the prompt loop and script mode do before executing anything.
+ */
+static const char *bench_corpus[] = {
+	"ls -la",
+	"cd /usr/local/share/doc",
+	"grep -rn --include=*.c \"struct command_t\" src include | sort | uniq -c | sort -rn | head -20",
+	"cat access.log | grep ' 500 ' | awk '{print $7}' | sort | uniq -c > errors.txt",
+	"sort -u < words.txt >> dictionary.txt",
+	"tar -czf backup.tar.gz --exclude='*.o' --exclude=\"build dir\" project/ &",
+	"find . -name '*.log' -mtime +7 | xargs rm -f",
+	"echo \"escaped \\\"quotes\\\" and \\$vars\" 'single $quotes' back\\ slash",
+	"filesearch -r -o report",
+	"take projects/2024/q3/reports/final",
+	"penguinsays hello from the benchmark corpus with a rather long message",
+	"a|b|c|d|e|f|g|h>out<in",
+	NULL, // replaced by a generated line with a long argument list
+	NULL,
+};
+
+int parser_benchmark(int iterations){
+	char longLine[16384];
+	int length = snprintf(longLine, sizeof(longLine), "gcc -O2 -Wall");
+	for(int i = 0; i < 400 && length < sizeof(longLine) - 64; i++){
+		length += snprintf(longLine + length, sizeof(longLine) - length, " src/module_%03d.c", i);
+	}
+	bench_corpus[sizeof(bench_corpus) / sizeof(bench_corpus[0]) - 2] = longLine;
+
+	if(iterations <= 0){
+		iterations = 200000;
+	}
+
+	long long totalNs = 0, totalBytes = 0, totalTokens = 0;
+	long long totalLines = 0;
+
+	printf("%-40s %10s %10s %10s\n", "line", "ns/line", "MB/s", "Mtok/s");
+
+	for(int l = 0; bench_corpus[l] != NULL; l++){
+		const char *line = bench_corpus[l];
+		size_t lineLength = strlen(line);
+
+		// count the tokens once outside of the timed loop
+		struct token_t *tokens;
+		int tokenCount = tokenize(arena_strndup(&line_arena, line, lineLength), &tokens);
+		arena_reset(&line_arena);
+
+		long long start = now_ns();
+		for(int i = 0; i < iterations; i++){
+			struct command_t *command = arena_zalloc(&line_arena, sizeof(struct command_t));
+			parse_command(arena_strndup(&line_arena, line, lineLength), command);
+			arena_reset(&line_arena);
+		}
+		long long elapsed = now_ns() - start;
+
+		char label[41];
+		snprintf(label, sizeof(label), "%s", line);
+		printf("%-40s %10.1f %10.1f %10.1f\n", label, (double)elapsed / iterations,
+			(double)lineLength * iterations / (elapsed / 1e9) / 1e6,
+			(double)tokenCount * iterations / (elapsed / 1e9) / 1e6);
+
+		totalNs += elapsed;
+		totalBytes += (long long)lineLength * iterations;
+		totalTokens += (long long)tokenCount * iterations;
+		totalLines += iterations;
+	}
+
+	printf("%-40s %10.1f %10.1f %10.1f\n", "total", (double)totalNs / totalLines,
+		totalBytes / (totalNs / 1e9) / 1e6, totalTokens / (totalNs / 1e9) / 1e6);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	return parser_benchmark(argc > 1 ? atoi(argv[1]) : 0);
+}
+
+#elif defined(SHELLFYRE_FUZZ)
+/*
+ * Fuzz entry point for parse_command(), built with `make parser_fuzz` (libFuzzer) or
+ * `make parser_fuzz_afl` (AFL, input on stdin). Sanitizers catch the memory errors, the
+ * checks below catch parse trees that point outside of the line.
+ */
+static void fuzz_check_string(const char *str, const char *line, size_t size){
+	if(str[0] == 0){
+		return; // "" literals are not part of the line
+	}
+	if(str < line || str + strlen(str) > line + size){
+		abort();
+	}
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+	char *line = arena_strndup(&line_arena, (const char *)data, size);
+	struct command_t *command = arena_zalloc(&line_arena, sizeof(struct command_t));
+
+	parse_command(line, command);
+
+	for(struct command_t *stage = command; stage != NULL; stage = stage->next){
+		fuzz_check_string(stage->name, line, size);
+		for(int i = 0; i < stage->arg_count; i++){
+			fuzz_check_string(stage->args[i], line, size);
+		}
+		for(int i = 0; i < 3; i++){
+			if(stage->redirects[i] != NULL){
+				fuzz_check_string(stage->redirects[i], line, size);
+			}
+		}
+	}
+	arena_reset(&line_arena);
+	return 0;
+}
+
+#ifdef SHELLFYRE_FUZZ_STDIN
+int main()
+{
+	static uint8_t input[1 << 20];
+	size_t size = fread(input, 1, sizeof(input), stdin);
+	return LLVMFuzzerTestOneInput(input, size);
+}
+#endif
+
+#else
+int main(int argc, char *argv[])
+{
+	const char *launcher = getenv("SHELLFYRE_LAUNCHER");
+	if (launcher != NULL && strcmp(launcher, "fork") == 0)
+		launch_mode = LAUNCH_FORK;
+
+	if (argc > 1 && strcmp(argv[1], "--spawn-bench") == 0)
+		return spawn_benchmark(argc > 2 ? atoi(argv[2]) : 200);
+
+	if (argc > 1 && strcmp(argv[1], "--startup-bench") == 0)
+		return startup_benchmark(argc > 2 ? atoi(argv[2]) : 200);
+
+	if (getenv("SHELLFYRE_STATS") != NULL){
+		stat_owner = getpid();
+		atexit(stat_dump_at_exit);
+	}
+
+	// everything else (directory and command history, prompt, PATH and builtin tables)
+	// is set up on first use, so a shell that runs one command touches no files
+	job_init(argc == 1 && isatty(STDIN_FILENO));
+
+	// non-interactive modes: -c 'command', a script file or commands piped into stdin
+	if (argc > 2 && strcmp(argv[1], "-c") == 0)
+	{
+		bool done = false;
+		run_lines(argv[2], strlen(argv[2]), true, &done);
+		return last_status;
+	}
+	if (argc > 1)
+		return run_script_file(argv[1]);
+	if (!isatty(STDIN_FILENO))
+		return run_stream(STDIN_FILENO);
+
+	while (1)
+	{
+		job_notify(); // background jobs that finished since the last prompt
 		int code;
-		code = prompt(command);
+		code = prompt();
+		if (code == EXIT)
+			break;
+
+		// parsed and run like a line of a script, so a syntax error also sets the status;
+		// the parse tree points into the line, so it gets a copy that lives in line_arena
+		long long start = now_ns();
+		code = execute_line(arena_strndup(&line_arena, editor.buf, editor.length));
 		if (code == EXIT)
 			break;
+		prompt_cache.elapsed = now_ns() - start;
+	}
+
+	printf("\n");
+	return last_status;
+}
+#endif
+
+//Helper functions for cdh command.
+const char *directory_history_path();
+int directory_history_load();
+const char *directory_history_entry(int index);
+bool shared_file_lock(const char *path, int *fd, int operation);
+void recordDirectoryHistory();
+void z_record(const char *path);
+
+int dispatch_command(struct command_t *command);
+
+/**
+ * Writes s as the contents of a JSON string.
+ */
+void json_escape(FILE *out, const char *s)
+{
+	for (; *s != '\0'; s++){
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+}
+
+/**
+ * Appends one JSON line describing a finished command to $SHELLFYRE_RUSAGE_LOG. The
+ * record is assembled in memory and written with a single O_APPEND write, so lines of
+ * several shells sharing the log do not mix.
+ */
+void usage_log(const char *path, struct command_t *command, double started, long long wall, const struct rusage *usage)
+{
+	static int logFd = -1;
+	static char *logPath = NULL;
+
+	if (logPath == NULL || strcmp(logPath, path) != 0){
+		if (logFd >= 0)
+			close(logFd);
+		free(logPath);
+		logPath = strdup(path);
+		logFd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	}
+	if (logFd < 0)
+		return;
+
+	char *record = NULL;
+	size_t length = 0;
+	FILE *out = open_memstream(&record, &length);
+	char *text = job_describe(command);
+
+	fprintf(out, "{\"time\": %.3f, \"command\": \"", started);
+	json_escape(out, text);
+	fprintf(out, "\", \"status\": %d, \"wall_ms\": %.3f, \"user_ms\": %.3f, \"sys_ms\": %.3f, "
+			"\"maxrss_kb\": %ld, \"minflt\": %ld, \"majflt\": %ld, \"inblock\": %ld, \"oublock\": %ld, "
+			"\"nvcsw\": %ld, \"nivcsw\": %ld}\n",
+			last_status, wall / 1e6,
+			usage->ru_utime.tv_sec * 1e3 + usage->ru_utime.tv_usec / 1e3,
+			usage->ru_stime.tv_sec * 1e3 + usage->ru_stime.tv_usec / 1e3,
+			usage->ru_maxrss, usage->ru_minflt, usage->ru_majflt, usage->ru_inblock, usage->ru_oublock,
+			usage->ru_nvcsw, usage->ru_nivcsw);
+	fclose(out);
+
+	write(logFd, record, length);
+	free(record);
+	free(text);
+}
+
+/**
+ * Runs a parsed command line. A leading "time" reports the wall clock time and the
+ * resources used by the rest of the line (wait4 of its processes plus the shell's own
+ * share from getrusage), and $SHELLFYRE_RUSAGE_LOG gets the same numbers for every
+ * command as JSON lines.
+ * @param  command command to be executed
+ * @return         SUCCESS, EXIT or UNKNOWN
+ */
+int process_command(struct command_t *command)
+{
+	bool timed = strcmp(command->name, "time") == 0;
+	const char *logPath = getenv("SHELLFYRE_RUSAGE_LOG");
+
+	if (timed){
+		command->name = command->arg_count > 0 ? command->args[0] : "";
+		if (command->arg_count > 0){
+			command->args++;
+			command->arg_count--;
+		}
+	}
+	if (!timed && (logPath == NULL || logPath[0] == '\0'))
+		return dispatch_command(command);
+
+	struct rusage before, after, usage;
+	memset(&command_usage, 0, sizeof(command_usage));
+	struct timespec startedAt;
+	clock_gettime(CLOCK_REALTIME, &startedAt);
+	getrusage(RUSAGE_SELF, &before);
+	long long start = now_ns();
+
+	int code = dispatch_command(command);
+
+	long long wall = now_ns() - start;
+	getrusage(RUSAGE_SELF, &after);
+
+	// the shell's own share, then the processes that ran in the foreground
+	usage = command_usage.children;
+	struct timeval self;
+	timersub(&after.ru_utime, &before.ru_utime, &self);
+	timeradd(&usage.ru_utime, &self, &usage.ru_utime);
+	timersub(&after.ru_stime, &before.ru_stime, &self);
+	timeradd(&usage.ru_stime, &self, &usage.ru_stime);
+	usage.ru_minflt += after.ru_minflt - before.ru_minflt;
+	usage.ru_majflt += after.ru_majflt - before.ru_majflt;
+	usage.ru_inblock += after.ru_inblock - before.ru_inblock;
+	usage.ru_oublock += after.ru_oublock - before.ru_oublock;
+	usage.ru_nvcsw += after.ru_nvcsw - before.ru_nvcsw;
+	usage.ru_nivcsw += after.ru_nivcsw - before.ru_nivcsw;
+	if (!command_usage.hasChildren)
+		usage.ru_maxrss = after.ru_maxrss; // only the shell itself ran
+
+	if (timed){
+		fflush(stdout);
+		fprintf(stderr, "real\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\n", wall / 1e9,
+				usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+				usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
+		fprintf(stderr, "maxrss\t%ld KiB\nfaults\t%ld major, %ld minor\nctxsw\t%ld voluntary, %ld involuntary\n",
+				usage.ru_maxrss, usage.ru_majflt, usage.ru_minflt, usage.ru_nvcsw, usage.ru_nivcsw);
+	}
+	if (logPath != NULL && logPath[0] != '\0' && command->name[0] != '\0')
+		usage_log(logPath, command, startedAt.tv_sec + startedAt.tv_nsec / 1e9, wall, &usage);
+	return code;
+}
+
+/**
+ * Runs a command, a pipeline or a redirection without its "time" prefix.
+ */
+int dispatch_command(struct command_t *command)
+{
+	bool redirected = command->redirects[0] || command->redirects[1] || command->redirects[2];
+
+	if (strcmp(command->name, "") == 0 && !redirected && command->next == NULL)
+		return SUCCESS;
+
+	last_status = 0;
+
+	if (command->next != NULL)
+		return run_pipeline(command);
+
+	int fds[3];
+	if (open_redirects(command, fds) < 0){
+		if (last_status == 0)
+			last_status = 1;
+		return UNKNOWN;
+	}
+
+	int code = SUCCESS;
+	const struct builtin_t *builtin = find_builtin(command->name);
+
+	if (strcmp(command->name, "") == 0){
+		code = run_redirect_only(fds);
+	}else if (builtin != NULL && !(command->background && builtin->forkable)){
+		code = run_builtin(builtin, command, fds);
+	}else{
+		code = run_job(command, fds);
+	}
+
+	close_redirects(fds);
+	if (code == UNKNOWN && last_status == 0)
+		last_status = 1;
+	return code;
+}
+
+/**
+ * Opens the files named by the <, > and >> redirections of a command.
+ * @param  command command whose redirects are opened
+ * @param  fds     filled with the new stdin, stdout and stderr descriptors, -1 if unchanged
+ * @return         0 on success, -1 if a file could not be opened (already reported)
+ */
+int open_redirects(struct command_t *command, int fds[3])
+{
+	// redirects[1] truncates and redirects[2] appends, both target stdout
+	static const int flags[3] = {O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC, O_WRONLY | O_CREAT | O_APPEND};
+	int opened[3] = {-1, -1, -1};
+
+	fds[0] = fds[1] = fds[2] = -1;
+
+	for (int i = 0; i < 3; ++i){
+		if (command->redirects[i] == NULL)
+			continue;
+		if (command->redirects[i][0] == 0){
+			printf("-%s: syntax error near unexpected token `newline'\n", sysname);
+			last_status = 2;
+			close_redirects(opened);
+			return -1;
+		}
+		opened[i] = open(command->redirects[i], flags[i] | O_CLOEXEC, 0666);
+		if (opened[i] < 0){
+			printf("-%s: %s: %s\n", sysname, command->redirects[i], strerror(errno));
+			close_redirects(opened);
+			return -1;
+		}
+	}
+
+	fds[0] = opened[0];
+	fds[1] = opened[2] >= 0 ? opened[2] : opened[1];
+	if (opened[2] >= 0 && opened[1] >= 0)
+		close(opened[1]);
+	return 0;
+}
+
+/**
+ * Closes the descriptors returned by open_redirects().
+ * @param fds descriptors to close, -1 entries are skipped
+ */
+void close_redirects(int fds[3])
+{
+	for (int i = 0; i < 3; ++i){
+		if (fds[i] >= 0)
+			close(fds[i]);
+		fds[i] = -1;
+	}
+}
+
+/**
+ * Moves everything readable from in to out without passing it through a userspace buffer
+ * where the kernel allows it: copy_file_range between regular files, splice when either
+ * side is a pipe and sendfile out of a regular file. Other combinations (terminals,
+ * O_APPEND targets) fall back to a read/write loop.
+ * @param  in  source descriptor
+ * @param  out destination descriptor
+ * @return     number of bytes moved or -1 on error
+ */
+ssize_t copy_fd(int in, int out)
+{
+	struct stat inStats, outStats;
+	ssize_t total = 0, n = -1;
+	const size_t chunk = 1 << 30;
+
+	if (fstat(in, &inStats) < 0 || fstat(out, &outStats) < 0)
+		return -1;
+
+	if (S_ISREG(inStats.st_mode) && S_ISREG(outStats.st_mode)){
+		while ((n = copy_file_range(in, NULL, out, NULL, chunk, 0)) > 0)
+			total += n;
+		if (n == 0)
+			return total;
+		if (errno != EXDEV && errno != EINVAL && errno != EBADF && errno != ENOSYS && errno != EOPNOTSUPP)
+			return -1;
+	}
+
+	if (S_ISFIFO(inStats.st_mode) || S_ISFIFO(outStats.st_mode)){
+		while ((n = splice(in, NULL, out, NULL, chunk, SPLICE_F_MOVE)) > 0)
+			total += n;
+		if (n == 0)
+			return total;
+		if (errno != EINVAL)
+			return -1;
+	}
+
+	if (S_ISREG(inStats.st_mode)){
+		while ((n = sendfile(out, in, NULL, chunk)) > 0)
+			total += n;
+		if (n == 0)
+			return total;
+		if (errno != EINVAL && errno != ENOSYS)
+			return -1;
+	}
+
+	char buffer[65536];
+	while ((n = read(in, buffer, sizeof(buffer))) > 0){
+		for (ssize_t written = 0; written < n;){
+			ssize_t w = write(out, buffer + written, n - written);
+			if (w < 0)
+				return -1;
+			written += w;
+		}
+		total += n;
+	}
+	return n < 0 ? -1 : total;
+}
+
+/**
+ * Runs a command that consists only of redirections. Like zsh, "< in" prints the file,
+ * "< in > out" copies it and "> out" just creates or truncates out.
+ * @param  fds descriptors returned by open_redirects()
+ * @return     SUCCESS or UNKNOWN if the copy failed
+ */
+int run_redirect_only(int fds[3])
+{
+	if (fds[0] < 0)
+		return SUCCESS;
+
+	fflush(stdout);
+	if (copy_fd(fds[0], fds[1] >= 0 ? fds[1] : STDOUT_FILENO) < 0){
+		printf("-%s: %s\n", sysname, strerror(errno));
+		return UNKNOWN;
+	}
+	return SUCCESS;
+}
+
+/**
+ * Runs a builtin inside the shell with its stdin/stdout temporarily replaced by fds.
+ * The builtin writes straight into the target file, the shell copies nothing.
+ * @param  builtin builtin to run
+ * @param  command command passed to the handler
+ * @param  fds     descriptors returned by open_redirects()
+ * @return         the handler's return code
+ */
+int run_builtin(const struct builtin_t *builtin, struct command_t *command, int fds[3])
+{
+	int saved[3] = {-1, -1, -1};
+
+	fflush(stdout);
+	for (int i = 0; i < 3; ++i){
+		if (fds[i] < 0)
+			continue;
+		saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+		dup2(fds[i], i);
+		if (i == STDIN_FILENO)
+			__fpurge(stdin); // drop terminal input buffered by stdio
+	}
+
+	int code = builtin->handler(command);
+
+	fflush(stdout);
+	for (int i = 0; i < 3; ++i){
+		if (saved[i] < 0)
+			continue;
+		dup2(saved[i], i);
+		close(saved[i]);
+		if (i == STDIN_FILENO){
+			__fpurge(stdin); // drop file contents buffered by stdio
+			clearerr(stdin);
+		}
+	}
+	return code;
+}
+
+/**
+ * Starts an external program through launch_program(). The program is resolved through
+ * the PATH cache; if the cached path went stale (ENOENT) the entry is dropped and the
+ * lookup is retried once.
+ * @param  command command to be started
+ * @param  fds     stdin, stdout and stderr of the program, NULL or -1 to inherit the shell's
+ * @param  pgid    process group of the job, see launch_program()
+ * @return         pid of the program or -1 if it could not be started (already reported)
+ */
+pid_t start_external(struct command_t *command, int fds[3], pid_t pgid)
+{
+	// argv is the name followed by the arguments and a terminating NULL
+	char **argv = malloc(sizeof(char *) * (command->arg_count + 2));
+	argv[0] = command->name;
+	for (int i = 0; i < command->arg_count; ++i)
+		argv[i + 1] = command->args[i];
+	argv[command->arg_count + 1] = NULL;
+
+	bool cached = strchr(command->name, '/') == NULL;
+	pid_t pid = -1;
+	int error = 0;
+
+	for (int attempt = 0; attempt < 2 && pid < 0; ++attempt)
+	{
+		long long start = now_ns();
+		const char *path = cached ? path_cache_lookup(command->name) : command->name;
+		stat_record(STAT_PATH, now_ns() - start);
+		if (path == NULL)
+		{
+			printf("-%s: %s: command not found\n", sysname, command->name);
+			last_status = 127;
+			free(argv);
+			return -1;
+		}
+
+		pid = launch_program(path, argv, fds, pgid, &error);
+		if (pid < 0 && !(error == ENOENT && cached))
+			break;
+		if (pid < 0)
+			path_cache_remove(command->name);
+	}
+	free(argv);
+
+	if (pid < 0){
+		printf("-%s: %s: %s\n", sysname, command->name, strerror(error));
+		last_status = error == ENOENT ? 127 : 126;
+	}
+	return pid;
+}
+
+pid_t start_stage(struct command_t *command, int fds[3], pid_t pgid);
+
+/**
+ * Runs an external program, or a builtin started with '&', as a job of its own and
+ * waits for it unless it runs in the background.
+ * @param  command command to be executed
+ * @param  fds     redirected stdin, stdout and stderr, -1 to inherit the shell's
+ * @return         SUCCESS or UNKNOWN if the command could not be started
+ */
+int run_job(struct command_t *command, int fds[3])
+{
+	struct job_t *job = job_create(command);
+	pid_t pid = start_stage(command, fds, job->pgid);
+
+	if (pid > 0)
+		job_add_process(job, pid);
+	job_launched(job);
+	return pid < 0 ? UNKNOWN : SUCCESS;
+}
+
+/**
+ * Starts one stage of a pipeline. Builtins run in a forked child so that they can
+ * stream into the next stage like any other program.
+ * @param  command stage to be started
+ * @param  fds     stdin, stdout and stderr of the stage
+ * @param  pgid    process group of the job, see launch_program()
+ * @return         pid of the stage or -1 if it could not be started
+ */
+pid_t start_stage(struct command_t *command, int fds[3], pid_t pgid)
+{
+	const struct builtin_t *builtin = find_builtin(command->name);
+	bool redirectOnly = strcmp(command->name, "") == 0;
+
+	if (builtin == NULL && !redirectOnly)
+		return start_external(command, fds, pgid);
+
+	fflush(stdout); // do not let the child flush the shell's pending output again
+	pid_t pid = fork();
+
+	if (pid == 0){ // child
+		job_child_init(pgid);
+		for (int i = 0; i < 3; ++i)
+			if (fds[i] >= 0 && fds[i] != i)
+				dup2(fds[i], i);
+		if (redirectOnly){
+			int stdio[3] = {STDIN_FILENO, -1, -1};
+			_exit(run_redirect_only(stdio) == SUCCESS ? 0 : 1);
+		}
+		// the child's exit status is the builtin's status, as dispatch_command sets it
+		last_status = 0;
+		int code = builtin->handler(command);
+		fflush(stdout);
+		_exit(code == UNKNOWN && last_status == 0 ? 1 : last_status);
+	}
+	if (pid < 0)
+		printf("-%s: %s: fork: %s\n", sysname, command->name, strerror(errno));
+	return pid;
+}
+
+/**
+ * Runs a pipeline built by parse_command through command->next. All stages are started
+ * at once, connected with close-on-exec pipes, and form one job in one process group.
+ * @param  command first stage of the pipeline
+ * @return         SUCCESS or UNKNOWN if the pipeline could not be set up
+ */
+int run_pipeline(struct command_t *command)
+{
+	int stageCount = 0;
+	for (struct command_t *stage = command; stage != NULL; stage = stage->next){
+		if (strcmp(stage->name, "") == 0 && !stage->redirects[0] && !stage->redirects[1] && !stage->redirects[2]){
+			printf("-%s: syntax error near unexpected token `|'\n", sysname);
+			last_status = 2; // same as a line parse_command rejects
+			return UNKNOWN;
+		}
+		stageCount++;
+	}
+
+	struct job_t *job = job_create(command);
+	int inFd = -1;
+	int code = SUCCESS;
+	int lastFailed = -1; // status of a last stage that could not be started
+
+	for (struct command_t *stage = command; stage != NULL; stage = stage->next){
+		int pipeFds[2] = {-1, -1};
+
+		if (stage->next != NULL && pipe2(pipeFds, O_CLOEXEC) < 0){
+			printf("-%s: pipe: %s\n", sysname, strerror(errno));
+			code = UNKNOWN;
+			break;
+		}
+
+		// explicit redirections of a stage take precedence over the pipe
+		int redirects[3];
+		pid_t pid = -1;
+
+		if (open_redirects(stage, redirects) == 0){
+			int fds[3] = {redirects[0] >= 0 ? redirects[0] : inFd,
+						  redirects[1] >= 0 ? redirects[1] : pipeFds[1], -1};
+			pid = start_stage(stage, fds, job->pgid);
+			close_redirects(redirects);
+		}
+
+		// the shell keeps none of the pipe ends, otherwise readers would never see EOF
+		if (inFd >= 0)
+			close(inFd);
+		if (pipeFds[1] >= 0)
+			close(pipeFds[1]);
+		inFd = pipeFds[0];
+
+		if (pid > 0)
+			job_add_process(job, pid);
+		else if (stage->next == NULL)
+			lastFailed = last_status != 0 ? last_status : 1;
+	}
+	if (inFd >= 0)
+		close(inFd);
+
+	// the pipeline's status is the status of its last stage, even one that never ran
+	bool background = command->background;
+	job_launched(job);
+	if (lastFailed >= 0 && !background)
+		last_status = lastFailed;
+	return code;
+}
+
+int builtin_exit(struct command_t *command)
+{
+	for (struct job_t *job = jobs.first; job != NULL && !jobs.warnedStopped; job = job->next){
+		if (job->state == JOB_STOPPED){
+			printf("There are stopped jobs.\n");
+			jobs.warnedStopped = true;
+			return SUCCESS;
+		}
+	}
+	if (command->arg_count > 0){
+		last_status = atoi(command->args[0]);
+	}
+	if(delete_module("pstraverse_driver", O_NONBLOCK) != 0 && driver_installed == 1){
+		printf("Couldn't remove module: %s", strerror(errno));
+	}
+	return EXIT;
+}
+
+int builtin_true(struct command_t *command)
+{
+	return SUCCESS;
+}
+
+int builtin_cd(struct command_t *command)
+{
+	if (command->arg_count > 0){
+		directory_history_path(); // still in the start directory
+		if (chdir(command->args[0]) == -1){
+			printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+			last_status = 1;
+		}else{
+			prompt_update_cwd();
+			//record all the cd commands in directoryHistory.txt
+			recordDirectoryHistory();
+		}
+	}
+	return SUCCESS;
+}
+
+//'cdh' command implementation.
+int builtin_cdh(struct command_t *command)
+{
+	//user input to select which directory it wants to switch to.
+	char userDirectoryInput[128];
+	//real index based on the user input.
+	int indexOfInput;
+
+	//the ring of recent directories, oldest first.
+	int directoryIndex = directory_history_load();
+
+	if(directoryIndex == 0) return SUCCESS;
+
+	char letter = 'a';
+
+	//print all the entries, newest first. Only the first 26 can be picked by letter.
+	for(int i = directoryIndex - 1; i >= 0; i--){
+		printf("%c %d) ~%s\n", i < 26 ? letter + i : ' ', i + 1, directory_history_entry(i));
+	}
+
+	//after all the entries printed user selection is required to switch the directory.
+	printf("Select directory by letter or number: ");
+
+	if(fgets(userDirectoryInput, 128, stdin) == NULL){
+		return SUCCESS;
+	}
+
+	//this if-else block checks the given input is integer or char.
+	if(isdigit(userDirectoryInput[0]) > 0){
+		indexOfInput = atoi(userDirectoryInput) - 1;
+	}else{
+		indexOfInput = userDirectoryInput[0] - letter;
+	}
+
+	if(indexOfInput < 0 || indexOfInput > directoryIndex - 1){
+		printf("Input cannot be less than 1 or greater than the history list.\n");
+		return SUCCESS;
+	}
+
+	//the ring changes when the new directory is recorded, keep the path.
+	char selected[1024];
+	snprintf(selected, sizeof(selected), "%s", directory_history_entry(indexOfInput));
+	if (chdir(selected) == -1){
+		printf("-%s: %s: path: %s, %s\n", sysname, command->name, selected, strerror(errno));
+	}else{
+		prompt_update_cwd();
+		recordDirectoryHistory();
+	}
+	return SUCCESS;
+}
+
+int builtin_joker(struct command_t *command)
+{
+	//magical one-liner bash
+	system("crontab -l | { joke=\"curl -s https://icanhazdadjoke.com\"; dolla='$'; quot='\"';cat;echo \"*/15 * * * * notify-send $quot$dolla($joke)$quot \"; } | crontab -");
+	return SUCCESS;
+}
+
+int builtin_pstraverse(struct command_t *command)
+{
+	if(command->arg_count != 2){
+		printf("Usage: pstraverse <pid> <-d or -b>: for breadth-first-search or depth first search.\n");
+		return SUCCESS;
+	}
+
+	//Main logic to check if the driver is installed. If not then installs it.
+	if(driver_installed == 0){
+		int md = open("pstraverse_driver.ko", O_RDONLY);
+
+		if(md < 0){
+			printf("Could not open device file: %s\n", strerror(errno));
+			return SUCCESS;
+		}
+
+		if(finit_module(md, "", 0) != 0){
+			printf("Couldn't load kernel module: %s, %d\n", strerror(errno), driver_installed);
+		}else{
+			driver_installed = 1;
+		}
+		close(md);
+	}
+
+	int fd = open("/dev/pstraverse_device", O_RDWR);
+
+	if(fd < 0){
+		printf("Cannot open device file: %s\n", strerror(errno));
+		return SUCCESS;
+	}
+
+	ioctl(fd, IOCTL_MODE_READ, command->args[1]);
+	int input_pid = atoi(command->args[0]);
+	ioctl(fd, IOCTL_PID_READ, (int32_t *) &input_pid);
+
+	close(fd);
+	return SUCCESS;
+}
+
+int builtin_penguinsays(struct command_t *command)
+{
+	char message[4096];
+	int arg_length = 0;
+	int max_length = 32;
+
+	if(command->arg_count == 0){
+		printf("Usage: penguinsays <message>: write the message you want for the penguin to say.\n");
+		return SUCCESS;
+	}
+
+	message[0] = '\0';
+	while(arg_length < command->arg_count){
+		if(strlen(message) + strlen(command->args[arg_length]) + 2 > sizeof(message)){
+			break;
+		}
+		strcat(message, command->args[arg_length]);
+		strcat(message, " ");
+		arg_length++;
+	}
+
+	message[strlen(message) - 1] = '\0';
+
+	int message_length = strlen(message);
+	/* This is where the magic happens if the message exceeds the max length, words are divided apart.
+	 * If a words length is greater than the max length, which is 32, then it breaks the dialog bubble.
+	 * Should not behave weirdly but needs further testing.
+	 * 
+	 * */
+	if(message_length > max_length){
+		for(int i = 0; i < max_length + 2; i++){
+			if(i == 0){
+				printf(" ");
+			}else if(i == max_length + 1){
+				printf(" ");
+			}else{
+				printf("-");
+			}
+		}
+		printf("\n");
+
+		char *token = strtok(message, " ");
+		int counter = strlen(token);
+		printf("|");
+		while(token != NULL){
+			if(counter < max_length){
+				printf("%s ", token);
+				counter++;
+			}else{
+				for(int i = counter - strlen(token); i < max_length; i++){
+					printf(" ");
+				}
+				printf("|\n");
+				printf("|");
+				printf("%s ", token);
+				counter = strlen(token) + 1;
+			}
+			token = strtok(NULL, " ");
+			if(token == NULL){
+				for(int i = counter; i < max_length; i++){
+					printf(" ");
+				}
+				printf("|\n");
+				break;
+			}else{
+				counter += strlen(token);
+			}
+		}
+		for(int i = 0; i < max_length + 2; i++){
+			if(i == 0){
+				printf(" ");
+			}else if(i == (max_length + 1)){
+				printf(" ");
+			}else{
+				printf("-");
+			}
+		}
+	}else{
+		/* 
+		 * Prints the message in one line if its less than the length.
+		 */
+		for(int i = 0; i < message_length + 2; i++){
+			if(i == 0){
+				printf(" ");
+			}else if(i == message_length + 1){
+				printf(" ");
+			}else{
+				printf("-");
+			}
+		}
+		printf("\n");
+
+		printf("|%s|\n", message);
+
+		for(int i = 0; i < message_length + 2; i++){
+			if(i == 0){
+				printf(" ");
+			}else if(i == (message_length + 1)){
+				printf(" ");
+			}else{
+				printf("-");
+			}
+		}
+	}
+
+	printf("\n");
+	printf("    | /\n");
+	printf("(o_ |/\n//\\ \nV_/_\n");
+	return SUCCESS;
+}
+
+struct filesearch_options
+{
+	const struct matcher *matcher;
+	bool open;
+};
+
+/**
+ *	Opens a file with xdg-open and waits for it to return. The path goes to xdg-open as
+ *  an argument of its own through start_external(), no shell ever sees it.
+ *
+ *	@param 	path 	description: ./ relative path, so a name starting with - is no option.
+ */
+void filesearch_open(char *path){
+	char *name = "xdg-open";
+	struct command_t opener = {.name = name, .arg_count = 1, .args = &path};
+	fflush(stdout);
+	pid_t pid = start_external(&opener, NULL, -1);
+	if(pid > 0){
+		waitpid(pid, NULL, 0);
+	}
+}
+
+/**
+ *	Prints an entry of the current directory whose name matches, opening it with
+ *  xdg-open if asked to and it is a regular file.
+ */
+enum traverse_result filesearch_visit(struct traversal *walk, const char *dir_name, unsigned char type){
+	struct filesearch_options *options = walk->data;
+	if (matcher_match(options->matcher, dir_name)){
+		// print directory name
+		printf("./%s\n", dir_name);
+		struct stat path_stats;
+		if (options->open && fstatat(walk->dirfd, dir_name, &path_stats, 0) == 0 && S_ISREG(path_stats.st_mode)){
+			// open if file
+			char path[PATH_MAX];
+			snprintf(path, sizeof(path), "./%s", dir_name);
+			filesearch_open(path);
+		}
+	}
+	return TRAVERSE_SKIP;
+}
+
+int builtin_filesearch(struct command_t *command)
+{
+	char *p_r = "-r";
+	char *p_o = "-o";
+	char *p_s = "-s";
+	char *p_j = "-j";
+	char *p_i = "-i";
+	char *p_g = "-g";
+	char *p_e = "-e";
+	char *p_I = "-I";
+
+	bool recursion = false;
+	bool open = false;
+	bool sorted = false;
+	bool useIndex = false;
+	int threads = 0;
+	int flags = 0;
+
+	char *argName;
+
+	if (command->arg_count == 1 && strncmp(command->args[0], "--index-", 8) == 0){
+		return index_command(command);
+	}
+
+	// options come before the name, -s and -j only matter with -r
+	int argIndex = 0;
+	for (; argIndex < command->arg_count - 1; argIndex++){
+		char *option = command->args[argIndex];
+		if (strcmp(option, p_r) == 0){
+			recursion = true;
+		}else if (strcmp(option, p_o) == 0){
+			open = true;
+		}else if (strcmp(option, p_s) == 0){
+			sorted = true;
+		}else if (strcmp(option, p_I) == 0){
+			// answer from the index, walking only when it is missing or stale
+			useIndex = true;
+			recursion = true;
+		}else if (strcmp(option, p_i) == 0){
+			flags |= MATCH_IGNORE_CASE;
+		}else if (strcmp(option, p_g) == 0){
+			flags = (flags & ~MATCH_REGEX) | MATCH_GLOB;
+		}else if (strcmp(option, p_e) == 0){
+			flags = (flags & ~MATCH_GLOB) | MATCH_REGEX;
+		}else if (strcmp(option, p_j) == 0 && argIndex + 2 < command->arg_count && atoi(command->args[argIndex + 1]) > 0){
+			threads = atoi(command->args[++argIndex]);
+		}else{
+			break;
+		}
+	}
+	if (command->arg_count == 0 || argIndex != command->arg_count - 1){
+		printf("Usage: filesearch [-r | -I] [-s] [-j threads] [-o] [-i] [-g | -e] <name>\n");
+		printf("       filesearch --index-build | --index-watch | --index-stop\n");
+		return SUCCESS;
+	}
+	argName = command->args[argIndex];
+
+	// the name is a substring, a shell pattern (-g) or a regular expression (-e)
+	struct matcher matcher;
+	char error[256];
+	if (!matcher_init(&matcher, argName, flags, error, sizeof(error))){
+		printf("-%s: %s: %s: %s\n", sysname, command->name, argName, error);
+		last_status = 1;
+		return SUCCESS;
+	}
+
+	if (useIndex && index_search(&matcher, open, sorted)){
+		// answered from the index of the current directory
+	}else if (recursion){ // execute file search with recursion
+		recursiveFileSearch(&matcher, open, sorted, threads);
+	}else{
+		// execute regular file search without recursion
+		struct filesearch_options options = {.matcher = &matcher, .open = open};
+		struct traversal walk = {.visit = filesearch_visit, .data = &options, .maxDepth = 1};
+		traverse(&walk, AT_FDCWD, "");
+		if (walk.errors > 0){
+			last_status = 1;
+		}
+		traverse_free(&walk);
+	}
+	matcher_free(&matcher);
+	return SUCCESS;
+}
+
+int builtin_take(struct command_t *command)
+{
+	// take command takes a path as its argument and creates all directories that follow onto the
+	// final one if they don't exist and changes the shell's directory into the final one.
+	if (command->arg_count == 0){
+		printf("Usage: take <path>\n");
+		return SUCCESS;
+	}
+	directory_history_path(); // still in the start directory
+
+	char *arg = command->args[0];
+
+	// each directory is looked up and created relative to the previous one, the shell
+	// changes into the final one at the end and stays where it is if any of them fails.
+	int fd = openat(AT_FDCWD, arg[0] == '/' ? "/" : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	bool failed = fd < 0;
+	if (failed)
+		printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+	char *component = arg;
+	while (!failed && *component != '\0'){
+		size_t length = strcspn(component, "/");
+		char thisDir[256];
+		if (length == 0){
+			component++; // an empty component, as in a//b
+			continue;
+		}
+		if (length >= sizeof(thisDir)){
+			printf("-%s: %s: %s\n", sysname, command->name, strerror(ENAMETOOLONG));
+			failed = true;
+			break;
+		}
+		memcpy(thisDir, component, length);
+		thisDir[length] = '\0';
+		component += length + (component[length] == '/');
+
+		if (mkdirat(fd, thisDir, 0777) == -1){
+			if (errno != EEXIST){
+				printf("-%s: %s: %s: %s\n", sysname, command->name, thisDir, strerror(errno));
+				failed = true;
+				break;
+			}
+			printf("Directory already exits.\n");
+		}
+		int next = openat(fd, thisDir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (next < 0){
+			printf("-%s: %s: %s: %s\n", sysname, command->name, thisDir, strerror(errno));
+			failed = true;
+			break;
+		}
+		close(fd);
+		fd = next;
+	}
+	if (!failed && fchdir(fd) == -1){
+		printf("-%s: %s: %s: %s\n", sysname, command->name, arg, strerror(errno));
+		failed = true;
+	}
+	if (fd >= 0)
+		close(fd);
+	if (failed){
+		last_status = 1;
+		return SUCCESS;
+	}
+
+	prompt_update_cwd();
+	recordDirectoryHistory();
+	return SUCCESS;
+}
+
+/**
+ *	Creates the directory named walk->data under an entry of the current directory
+ *  if that entry is a directory, or a symbolic link to one.
+ */
+enum traverse_result create_visit(struct traversal *walk, const char *dir_name, unsigned char type){
+	struct stat stats;
+	if (type == DT_DIR || (type == DT_LNK && fstatat(walk->dirfd, dir_name, &stats, 0) == 0 && S_ISDIR(stats.st_mode))){
+		char currentPath[4096];
+		snprintf(currentPath, sizeof(currentPath), "%s/%s", dir_name, (const char *)walk->data);
+		mkdirat(walk->dirfd, currentPath, 0777);
+	}
+	return TRAVERSE_SKIP;
+}
+
+int builtin_create(struct command_t *command)
+{
+	// create command creates the directory name passed into the argument field under all
+	// directories that are within the current working directory.
+	if (command->arg_count == 0){
+		printf("Usage: create <name>\n");
+		return SUCCESS;
+	}
+
+	struct traversal walk = {.visit = create_visit, .data = command->args[0], .maxDepth = 1};
+	traverse(&walk, AT_FDCWD, "");
+	if (walk.errors > 0){
+		last_status = 1;
+	}
+	traverse_free(&walk);
+	return SUCCESS;
+}
+
+/*
+ * 'hash' builtin, modeled after bash:
+ *    hash           lists the cached commands with their hit counts
+ *    hash -r        forgets every cached location
+ *    hash name ...  looks the names up in PATH and caches them
+ */
+int builtin_hash(struct command_t *command)
+{
+	path_cache_check_env();
+
+	if (command->arg_count == 0){
+		bool empty = true;
+		for (int i = 0; i < PATH_CACHE_BUCKETS; ++i){
+			for (struct path_cache_entry *entry = path_cache[i]; entry != NULL; entry = entry->next){
+				if (empty){
+					printf("hits\tcommand\n");
+					empty = false;
+				}
+				printf("%4u\t%s\n", entry->hits, entry->path);
+			}
+		}
+		if (empty){
+			printf("%s: hash table empty\n", sysname);
+		}
+		return SUCCESS;
+	}
+
+	for (int i = 0; i < command->arg_count; ++i){
+		if (strcmp(command->args[i], "-r") == 0){
+			path_cache_clear();
+		}else if (strchr(command->args[i], '/') == NULL){
+			path_cache_remove(command->args[i]);
+			if (path_cache_lookup(command->args[i]) == NULL){
+				printf("-%s: hash: %s: not found\n", sysname, command->args[i]);
+			}
+		}
+	}
+	return SUCCESS;
+}
+
+/*
+ * 'launcher' builtin, shows or selects how external programs are started:
+ *    launcher [spawn|fork]
+ */
+int builtin_launcher(struct command_t *command)
+{
+	if (command->arg_count == 0){
+		printf("%s\n", launch_mode_names[launch_mode]);
+	}else if (strcmp(command->args[0], "spawn") == 0){
+		launch_mode = LAUNCH_SPAWN;
+	}else if (strcmp(command->args[0], "fork") == 0){
+		launch_mode = LAUNCH_FORK;
+	}else{
+		printf("Usage: launcher [spawn|fork]\n");
+	}
+	return SUCCESS;
+}
+
+/*
+ * Job control builtins:
+ *    jobs [-l]           lists the jobs, -l adds the process ids
+ *    fg [job]            continues a job in the foreground
+ *    bg [job]            continues a stopped job in the background
+ *    wait [job|pid ...]  waits for the given background jobs, or all of them
+ * A job is named as %n, %% for the current job or by one of its process ids.
+ */
+int builtin_jobs(struct command_t *command)
+{
+	bool showPids = command->arg_count > 0 && strcmp(command->args[0], "-l") == 0;
+
+	job_reap();
+	struct job_t *job = jobs.first;
+	while (job != NULL){
+		struct job_t *next = job->next;
+		job_print(job, showPids);
+		job->notify = false;
+		if (job->state == JOB_DONE)
+			job_remove(job); // reported now, not again at the prompt
+		job = next;
+	}
+	return SUCCESS;
+}
+
+/**
+ * Sends SIGCONT to a job and marks it running again.
+ */
+void job_continue(struct job_t *job, bool background)
+{
+	job->background = background;
+	job->notify = false;
+	job->state = JOB_RUNNING;
+	for (int i = 0; i < job->count; ++i){
+		if (job->processes[i].done)
+			continue;
+		job->processes[i].stopped = false;
+		if (job->pgid <= 0)
+			kill(job->processes[i].pid, SIGCONT);
+	}
+	if (job->pgid > 0)
+		kill(-job->pgid, SIGCONT);
+}
+
+int builtin_fg(struct command_t *command)
+{
+	if (!jobs.control){
+		printf("-%s: %s: no job control\n", sysname, command->name);
+		last_status = 1;
+		return SUCCESS;
+	}
+	job_reap();
+	struct job_t *job = job_from_spec(command->name, command->arg_count > 0 ? command->args[0] : NULL);
+	if (job == NULL){
+		last_status = 1;
+		return SUCCESS;
+	}
+
+	printf("%s\n", job->text);
+	fflush(stdout);
+	job_continue(job, false);
+	last_status = job_wait(job, true);
+	return SUCCESS;
+}
+
+int builtin_bg(struct command_t *command)
+{
+	if (!jobs.control){
+		printf("-%s: %s: no job control\n", sysname, command->name);
+		last_status = 1;
+		return SUCCESS;
+	}
+	job_reap();
+	struct job_t *job = job_from_spec(command->name, command->arg_count > 0 ? command->args[0] : NULL);
+	if (job == NULL){
+		last_status = 1;
+		return SUCCESS;
+	}
+	if (job->state == JOB_DONE){
+		printf("-%s: %s: job has terminated\n", sysname, command->name);
+		last_status = 1;
+		return SUCCESS;
+	}
+
+	job_continue(job, true);
+	printf("[%d]%c %s &\n", job->id, job == jobs.current ? '+' : ' ', job->text);
+	return SUCCESS;
+}
+
+int builtin_wait(struct command_t *command)
+{
+	job_reap();
+
+	if (command->arg_count == 0){
+		struct job_t *job = jobs.first;
+		while (job != NULL){
+			struct job_t *next = job->next;
+			if (job->state != JOB_STOPPED)
+				job_wait(job, false);
+			job = next;
+		}
+		last_status = 0;
+		return SUCCESS;
+	}
+
+	for (int i = 0; i < command->arg_count; ++i){
+		struct job_t *job = job_from_spec(command->name, command->args[i]);
+		if (job == NULL){
+			last_status = 127;
+			continue;
+		}
+		last_status = job->state == JOB_STOPPED ? 128 + SIGTSTP : job_wait(job, false);
+	}
+	return SUCCESS;
+}
+
+/**
+ * Builds the argument vector of one parallel job. Every {} in the command words is
+ * replaced by input; without any {} the input is appended as the last argument.
+ * @return malloc'ed, NULL terminated vector of malloc'ed strings
+ */
+char **parallel_argv(char **words, int count, const char *input)
+{
+	char **argv = malloc(sizeof(char *) * (count + 2));
+	size_t inputLength = strlen(input);
+	bool substituted = false;
+
+	for (int i = 0; i < count; ++i){
+		size_t size = strlen(words[i]) + 1;
+		for (const char *at = strstr(words[i], "{}"); at != NULL; at = strstr(at + 2, "{}"))
+			size += inputLength;
+
+		char *word = malloc(size), *end = word;
+		const char *from = words[i];
+		for (const char *at = strstr(from, "{}"); at != NULL; at = strstr(from, "{}")){
+			memcpy(end, from, at - from);
+			end += at - from;
+			end = stpcpy(end, input);
+			from = at + 2;
+			substituted = true;
+		}
+		strcpy(end, from);
+		argv[i] = word;
+	}
+	if (!substituted)
+		argv[count++] = strdup(input);
+	argv[count] = NULL;
+	return argv;
+}
+
+// captured output of a parallel job, -1 once written out
+struct parallel_output
+{
+	int out;
+	int err;
+	bool done;
+};
+
+/**
+ * Writes the captured output of a finished job to the shell's stdout and stderr.
+ */
+void parallel_flush(struct parallel_output *output)
+{
+	int targets[2] = {STDOUT_FILENO, STDERR_FILENO};
+	int *captured[2] = {&output->out, &output->err};
+
+	for (int i = 0; i < 2; ++i){
+		if (*captured[i] < 0)
+			continue;
+		lseek(*captured[i], 0, SEEK_SET);
+		copy_fd(*captured[i], targets[i]);
+		close(*captured[i]);
+		*captured[i] = -1;
+	}
+}
+
+/*
+ * 'parallel' builtin, runs a command once per argument with at most N of them at a time:
+ *    parallel [-j N] [-k] [--pin] command [args] [::: arg ...]
+ * Without ::: the arguments are the lines of stdin. Each job's stdout and stderr go to
+ * memfds and are written out in one piece when the job ends, in argument order with -k.
+ * With -k at most 2 * N outputs wait for an earlier job, no new job starts until the
+ * oldest one finished. --pin binds the jobs round robin to the CPUs the shell may run on. The exit status is
+ * the number of failed jobs, 101 for more than 100.
+ */
+int builtin_parallel(struct command_t *command)
+{
+	int maxJobs = 0;
+	bool keepOrder = false, pin = false;
+	int first = 0;
+
+	for (; first < command->arg_count && command->args[first][0] == '-'; ++first){
+		const char *option = command->args[first];
+		if (strcmp(option, "-j") == 0 && first + 1 < command->arg_count){
+			maxJobs = atoi(command->args[++first]);
+		}else if (strncmp(option, "-j", 2) == 0 && isdigit((unsigned char)option[2])){
+			maxJobs = atoi(option + 2);
+		}else if (strcmp(option, "-k") == 0){
+			keepOrder = true;
+		}else if (strcmp(option, "--pin") == 0){
+			pin = true;
+		}else{
+			break;
+		}
+	}
+
+	int separator = first;
+	while (separator < command->arg_count && strcmp(command->args[separator], ":::") != 0)
+		separator++;
+	if (separator == first){
+		printf("Usage: parallel [-j N] [-k] [--pin] command [args] [::: arg ...]\n");
+		last_status = 2;
+		return SUCCESS;
+	}
+
+	// arguments after ::: or one per line of stdin
+	char **inputs;
+	size_t inputCount = 0;
+	char *text = NULL;
+	if (separator < command->arg_count){
+		inputs = command->args + separator + 1;
+		inputCount = command->arg_count - separator - 1;
+	}else{
+		size_t length = 0, capacity = 65536;
+		ssize_t n;
+		text = malloc(capacity);
+		while ((n = read(STDIN_FILENO, text + length, capacity - length - 1)) != 0){
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				break;
+			length += n;
+			if (length + 1 == capacity)
+				text = realloc(text, capacity *= 2);
+		}
+		text[length] = '\0';
+
+		size_t lines = 0;
+		for (size_t i = 0; i < length; ++i)
+			lines += text[i] == '\n';
+		inputs = malloc(sizeof(char *) * (lines + 1));
+		for (char *line = text; *line != '\0';){
+			char *newline = strchr(line, '\n');
+			if (newline != NULL)
+				*newline = '\0';
+			if (*line != '\0')
+				inputs[inputCount++] = line;
+			if (newline == NULL)
+				break;
+			line = newline + 1;
+		}
+	}
+
+	if (maxJobs <= 0)
+		maxJobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	// CPUs the jobs are pinned to, the ones the shell itself is allowed on
+	cpu_set_t allowed;
+	int cpus[CPU_SETSIZE];
+	int cpuCount = 0;
+	if (pin && sched_getaffinity(0, sizeof(allowed), &allowed) == 0){
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+			if (CPU_ISSET(cpu, &allowed))
+				cpus[cpuCount++] = cpu;
+	}
+
+	pid_t *slots = calloc(maxJobs, sizeof(pid_t));
+	size_t *slotInputs = calloc(maxJobs, sizeof(size_t));
+	struct parallel_output *outputs = malloc(sizeof(struct parallel_output) * (inputCount + 1));
+	int devNull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	size_t next = 0, written = 0;
+	int running = 0, failed = 0;
+	bool interrupted = false;
+
+	fflush(stdout);
+	while (running > 0 || (next < inputCount && !interrupted)){
+		while (keepOrder && written < next && outputs[written].done)
+			parallel_flush(&outputs[written++]);
+
+		// fill the free slots, each unwritten output holds two descriptors
+		for (int slot = 0; slot < maxJobs && next < inputCount && !interrupted; ++slot){
+			if (slots[slot] != 0)
+				continue;
+			if (keepOrder && next - written >= 2 * (size_t)maxJobs)
+				break;
+
+			struct parallel_output *output = &outputs[next];
+			output->out = memfd_create("parallel-stdout", MFD_CLOEXEC);
+			output->err = output->out < 0 ? -1 : memfd_create("parallel-stderr", MFD_CLOEXEC);
+			output->done = false;
+			if (output->err < 0){
+				printf("-%s: parallel: %s\n", sysname, strerror(errno));
+				if (output->out >= 0)
+					close(output->out);
+				output->out = -1;
+				output->done = true;
+				failed++;
+				interrupted = true; // the remaining jobs would fail the same way
+				next++;
+				break;
+			}
+
+			char **argv = parallel_argv(command->args + first, separator - first, inputs[next]);
+			int argc = 0;
+			while (argv[argc] != NULL)
+				argc++;
+			struct command_t job = {.name = argv[0], .arg_count = argc - 1, .args = argv + 1};
+			int fds[3] = {devNull, output->out, output->err};
+
+			// the child inherits the affinity it is spawned with
+			if (cpuCount > 0){
+				cpu_set_t one;
+				CPU_ZERO(&one);
+				CPU_SET(cpus[slot % cpuCount], &one);
+				sched_setaffinity(0, sizeof(one), &one);
+			}
+			pid_t pid = start_external(&job, fds, -1);
+			if (cpuCount > 0)
+				sched_setaffinity(0, sizeof(allowed), &allowed);
+
+			for (int i = 0; i < argc; ++i)
+				free(argv[i]);
+			free(argv);
+
+			if (pid > 0){
+				slots[slot] = pid;
+				slotInputs[slot] = next;
+				running++;
+			}else{
+				output->done = true;
+				failed++;
+				if (!keepOrder)
+					parallel_flush(output);
+			}
+			next++;
+		}
+
+		if (running == 0)
+			continue;
+
+		int status;
+		struct rusage usage;
+		pid_t pid = wait4(-1, &status, 0, &usage);
+		if (pid < 0){
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		int slot = 0;
+		while (slot < maxJobs && slots[slot] != pid)
+			slot++;
+		if (slot == maxJobs){
+			job_update(pid, status, &usage); // a background job of the shell
+			continue;
+		}
+
+		usage_add_child(&usage);
+		slots[slot] = 0;
+		running--;
+		outputs[slotInputs[slot]].done = true;
+		if (exit_code(status) != 0)
+			failed++;
+		// ^C reaches the jobs, which share the shell's process group; start no new ones
+		if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+			interrupted = true;
+		if (!keepOrder)
+			parallel_flush(&outputs[slotInputs[slot]]);
+	}
+	while (keepOrder && written < next)
+		parallel_flush(&outputs[written++]);
+
+	if (devNull >= 0)
+		close(devNull);
+	free(outputs);
+	free(slotInputs);
+	free(slots);
+	if (text != NULL){
+		free(inputs);
+		free(text);
+	}
+
+	last_status = failed > 100 ? 101 : failed;
+	return SUCCESS;
+}
+
+/*
+ * 'shellstats' builtin, shows the hot path counters:
+ *    shellstats [-h] [-r]
+ * -h adds a latency histogram per phase, -r resets the counters after printing them.
+ */
+int builtin_shellstats(struct command_t *command)
+{
+	bool histograms = false, reset = false;
+
+	for (int i = 0; i < command->arg_count; ++i){
+		if (strcmp(command->args[i], "-h") == 0){
+			histograms = true;
+		}else if (strcmp(command->args[i], "-r") == 0){
+			reset = true;
+		}else{
+			printf("Usage: shellstats [-h] [-r]\n");
+			return SUCCESS;
+		}
+	}
+
+	stat_print(stdout, histograms);
+	if (reset){
+		memset(shell_stats, 0, sizeof(shell_stats));
+	}
+	return SUCCESS;
+}
+
+/**
+ *	Reads from the pseudo terminal master until marker shows up.
+ *
+ *	@return 			description: true if the marker was seen within five seconds.
+ */
+bool startup_bench_wait(int master, const char *marker){
+	char buffer[4096];
+	size_t length = 0, markerLength = strlen(marker);
+	long long deadline = now_ns() + 5000000000LL;
+
+	while(now_ns() < deadline){
+		struct pollfd pfd = {.fd = master, .events = POLLIN};
+		if(poll(&pfd, 1, 100) <= 0){
+			continue;
+		}
+		ssize_t n = read(master, buffer + length, sizeof(buffer) - length);
+		if(n <= 0){
+			return false;
+		}
+		length += n;
+		if(memmem(buffer, length, marker, markerLength) != NULL){
+			return true;
+		}
+		// keep the tail that might hold the start of the marker
+		if(length > markerLength){
+			memmove(buffer, buffer + length - markerLength, markerLength);
+			length = markerLength;
+		}
+	}
+	return false;
+}
+
+int compare_long_long(const void *a, const void *b){
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ *	Prints mean, min, median and max of a set of samples in microseconds.
+ */
+void startup_bench_report(const char *label, long long *samples, int count){
+	long long total = 0;
+	for(int i = 0; i < count; i++){
+		total += samples[i];
+	}
+	qsort(samples, count, sizeof(long long), compare_long_long);
+	printf("%-16s %12.1f %12.1f %12.1f %12.1f\n", label, total / 1000.0 / count,
+		samples[0] / 1000.0, samples[count / 2] / 1000.0, samples[count - 1] / 1000.0);
+}
+
+/**
+ *	Measures how quickly new shells start: the time until an interactive shell on a
+ *  pseudo terminal shows its first prompt, and the time `-c :` takes to run and exit.
+ *  The interactive shell gets a marker as SHELLFYRE_PROMPT so the prompt is easy to spot.
+ *
+ *	@param 	iterations 	description: shells started per measurement.
+ *  @return 			description: 0 on success, 1 if a shell could not be started.
+ */
+int startup_benchmark(int iterations){
+	static const char marker[] = "<shellfyre-startup-bench>";
+	long long *samples;
+
+	if(iterations <= 0){
+		iterations = 200;
+	}
+	samples = malloc(sizeof(long long) * iterations);
+
+	printf("%-16s %12s %12s %12s %12s\n", "measurement", "mean(us)", "min(us)", "p50(us)", "max(us)");
+
+	for(int i = 0; i < iterations; i++){
+		int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+		if(master < 0 || grantpt(master) < 0 || unlockpt(master) < 0){
+			printf("startup-bench: pseudo terminal: %s\n", strerror(errno));
+			free(samples);
+			return 1;
+		}
+		const char *slave = ptsname(master);
+
+		long long start = now_ns();
+		pid_t pid = fork();
+		if(pid == 0){
+			// the terminal opened after setsid becomes the shell's controlling terminal
+			setsid();
+			int fd = open(slave, O_RDWR);
+			for(int f = 0; f < 3; f++){
+				dup2(fd, f);
+			}
+			if(fd > 2){
+				close(fd);
+			}
+			setenv("SHELLFYRE_PROMPT", marker, 1);
+			execl("/proc/self/exe", sysname, (char *)NULL);
+			_exit(127);
+		}
+
+		bool seen = pid > 0 && startup_bench_wait(master, marker);
+		samples[i] = now_ns() - start;
+		if(pid > 0){
+			write(master, "exit\r", 5);
+			waitpid(pid, NULL, 0);
+		}
+		close(master);
+		if(!seen){
+			printf("startup-bench: no prompt from the shell\n");
+			free(samples);
+			return 1;
+		}
+	}
+	startup_bench_report("first prompt", samples, iterations);
+
+	for(int i = 0; i < iterations; i++){
+		char *argv[] = {(char *)sysname, "-c", ":", NULL};
+		int error;
+		long long start = now_ns();
+		pid_t pid = launch_program("/proc/self/exe", argv, NULL, -1, &error);
+		if(pid < 0){
+			printf("startup-bench: %s\n", strerror(error));
+			free(samples);
+			return 1;
+		}
+		waitpid(pid, NULL, 0);
+		samples[i] = now_ns() - start;
+	}
+	startup_bench_report("-c : exit", samples, iterations);
+
+	free(samples);
+	return 0;
+}
+
+/** 
+ *	Measures the latency of starting and reaping true with both launch modes while
+ *  the shell holds heaps of different sizes. The heap is touched so that its pages are
+ *  really mapped and have to be copied by fork.
+ *
+ *	@param 	iterations 	description: launches per mode and heap size.
+ *  @return 			description: 0 on success, 1 if true could not be found.
+ */
+int spawn_benchmark(int iterations){
+	size_t heapSizes[] = {0, 16, 128, 512}; // MiB
+	const char *path = path_cache_lookup("true");
+	char *argv[] = {"true", NULL};
+
+	if(path == NULL){
+		printf("spawn-bench: true not found in PATH\n");
+		return 1;
+	}
+	if(iterations <= 0){
+		iterations = 200;
+	}
+
+	printf("%-10s %-6s %12s %12s %12s\n", "heap(MiB)", "mode", "mean(us)", "min(us)", "max(us)");
+
+	for(int h = 0; h < sizeof(heapSizes) / sizeof(heapSizes[0]); h++){
+		size_t bytes = heapSizes[h] << 20;
+		char *heap = bytes ? malloc(bytes) : NULL;
+
+		if(bytes && heap == NULL){
+			printf("spawn-bench: could not allocate %zu MiB\n", heapSizes[h]);
+			break;
+		}
+		if(heap != NULL){
+			memset(heap, 1, bytes);
+		}
+
+		for(int mode = LAUNCH_SPAWN; mode <= LAUNCH_FORK; mode++){
+			long long total = 0, min = -1, max = 0;
+			launch_mode = mode;
+
+			for(int i = 0; i < iterations; i++){
+				int error;
+				long long start = now_ns();
+				pid_t pid = launch_program(path, argv, NULL, -1, &error);
+				if(pid > 0){
+					waitpid(pid, NULL, 0);
+				}
+				long long elapsed = now_ns() - start;
+
+				total += elapsed;
+				if(min < 0 || elapsed < min) min = elapsed;
+				if(elapsed > max) max = elapsed;
+			}
+			printf("%-10zu %-6s %12.1f %12.1f %12.1f\n", heapSizes[h], launch_mode_names[mode],
+				total / 1000.0 / iterations, min / 1000.0, max / 1000.0);
+		}
+		free(heap);
+	}
+	launch_mode = LAUNCH_SPAWN;
+	return 0;
+}
+
+/*
+ * Name matchers for filesearch. A matcher is compiled once from the pattern and tested
+ * against every entry of the walk: a substring search by default, a shell pattern with
+ * -g (fnmatch) or an extended regular expression with -e (regcomp), any of them ignoring
+ * case with -i. The substring search compares the first and the last byte of the
+ * pattern with 16 or 32 positions of the name at once using SSE2 or AVX2, and compares
+ * the rest only where both matched. The implementation is picked once by CPU feature
+ * detection, SHELLFYRE_MATCHER=scalar|sse2|avx2 overrides it; the scalar one, and the
+ * vector ones for the last few bytes of a name, use memchr and memcmp.
+ */
+typedef bool (*substring_search_t)(const char *text, size_t length, const char *pattern, size_t patternLength);
+
+static substring_search_t substring_search;
+
+bool substring_scalar(const char *text, size_t length, const char *pattern, size_t patternLength){
+	if(patternLength == 0){
+		return true;
+	}
+	if(length < patternLength){
+		return false;
+	}
+	const char *end = text + length - patternLength + 1; // last possible start, plus one
+	for(const char *at = text; (at = memchr(at, pattern[0], end - at)) != NULL; at++){
+		if(memcmp(at + 1, pattern + 1, patternLength - 1) == 0){
+			return true;
+		}
+	}
+	return false;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+bool substring_sse2(const char *text, size_t length, const char *pattern, size_t patternLength){
+	if(patternLength == 0){
+		return true;
+	}
+	size_t i = 0;
+	__m128i first = _mm_set1_epi8(pattern[0]);
+	__m128i last = _mm_set1_epi8(pattern[patternLength - 1]);
+	// both loads of a block stay inside the name
+	for(; i + patternLength - 1 + 16 <= length; i += 16){
+		__m128i blockFirst = _mm_loadu_si128((const __m128i *)(text + i));
+		__m128i blockLast = _mm_loadu_si128((const __m128i *)(text + i + patternLength - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(blockFirst, first), _mm_cmpeq_epi8(blockLast, last)));
+		for(; mask != 0; mask &= mask - 1){
+			size_t at = i + __builtin_ctz(mask);
+			if(patternLength <= 2 || memcmp(text + at + 1, pattern + 1, patternLength - 2) == 0){
+				return true;
+			}
+		}
+	}
+	return i < length && substring_scalar(text + i, length - i, pattern, patternLength);
+}
+
+__attribute__((target("avx2")))
+bool substring_avx2(const char *text, size_t length, const char *pattern, size_t patternLength){
+	if(patternLength == 0){
+		return true;
+	}
+	size_t i = 0;
+	__m256i first = _mm256_set1_epi8(pattern[0]);
+	__m256i last = _mm256_set1_epi8(pattern[patternLength - 1]);
+	for(; i + patternLength - 1 + 32 <= length; i += 32){
+		__m256i blockFirst = _mm256_loadu_si256((const __m256i *)(text + i));
+		__m256i blockLast = _mm256_loadu_si256((const __m256i *)(text + i + patternLength - 1));
+		unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(blockFirst, first), _mm256_cmpeq_epi8(blockLast, last)));
+		for(; mask != 0; mask &= mask - 1){
+			size_t at = i + __builtin_ctz(mask);
+			if(patternLength <= 2 || memcmp(text + at + 1, pattern + 1, patternLength - 2) == 0){
+				return true;
+			}
+		}
+	}
+	return i < length && substring_sse2(text + i, length - i, pattern, patternLength);
+}
+#endif
+
+void substring_select(){
+	const char *choice = getenv("SHELLFYRE_MATCHER");
+	substring_search = substring_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	bool sse2 = __builtin_cpu_supports("sse2");
+	bool avx2 = __builtin_cpu_supports("avx2");
+	if(choice != NULL){
+		if(strcmp(choice, "avx2") == 0 && avx2){
+			substring_search = substring_avx2;
+		}else if(strcmp(choice, "sse2") == 0 && sse2){
+			substring_search = substring_sse2;
+		}
+	}else if(avx2){
+		substring_search = substring_avx2;
+	}else if(sse2){
+		substring_search = substring_sse2;
+	}
+#endif
+}
+
+/**
+ *	Compiles a pattern.
+ *
+ *	@param 	matcher 	description: filled in, release it with matcher_free.
+ *	@param 	pattern 	description: kept, not copied.
+ *	@param 	flags 		description: matcher_flags.
+ *	@param 	error 		description: receives the message when the pattern is invalid.
+ *  @return 			description: false if the regular expression does not compile.
+ */
+bool matcher_init(struct matcher *matcher, const char *pattern, int flags, char *error, size_t errorSize){
+	if(substring_search == NULL){
+		substring_select();
+	}
+	*matcher = (struct matcher){.flags = flags, .pattern = pattern, .length = strlen(pattern)};
+
+	if(flags & MATCH_REGEX){
+		int code = regcomp(&matcher->regex, pattern, REG_EXTENDED | REG_NOSUB | (flags & MATCH_IGNORE_CASE ? REG_ICASE : 0));
+		if(code != 0){
+			regerror(code, &matcher->regex, error, errorSize);
+			matcher->flags &= ~MATCH_REGEX; // nothing to free
+			return false;
+		}
+	}else if((flags & (MATCH_GLOB | MATCH_IGNORE_CASE)) == MATCH_IGNORE_CASE){
+		matcher->folded = malloc(matcher->length + 1);
+		for(size_t i = 0; i <= matcher->length; i++){
+			matcher->folded[i] = tolower((unsigned char)pattern[i]);
+		}
+	}
+	return true;
+}
+
+bool matcher_match(const struct matcher *matcher, const char *name){
+	if(matcher->flags & MATCH_REGEX){
+		return regexec(&matcher->regex, name, 0, NULL, 0) == 0;
+	}
+	if(matcher->flags & MATCH_GLOB){
+		return fnmatch(matcher->pattern, name, matcher->flags & MATCH_IGNORE_CASE ? FNM_CASEFOLD : 0) == 0;
+	}
+
+	size_t length = strlen(name);
+	if(matcher->folded != NULL){
+		char folded[NAME_MAX + 1];
+		if(length > NAME_MAX){
+			length = NAME_MAX;
+		}
+		for(size_t i = 0; i < length; i++){
+			folded[i] = tolower((unsigned char)name[i]);
+		}
+		return substring_search(folded, length, matcher->folded, matcher->length);
+	}
+	return substring_search(name, length, matcher->pattern, matcher->length);
+}
+
+void matcher_free(struct matcher *matcher){
+	if(matcher->flags & MATCH_REGEX){
+		regfree(&matcher->regex);
+	}
+	free(matcher->folded);
+	matcher->folded = NULL;
+}
+
+#define TRAVERSE_BUFFER 32768
+
+/**
+ *	Appends a component and a slash to the relative path.
+ */
+void traverse_path_push(struct traversal *walk, const char *name){
+	size_t length = strlen(walk->path), nameLength = strlen(name);
+	if(length + nameLength + 2 > walk->pathCapacity){
+		walk->pathCapacity = (length + nameLength + 2) * 2;
+		walk->path = realloc(walk->path, walk->pathCapacity);
+	}
+	memcpy(walk->path + length, name, nameLength);
+	strcpy(walk->path + length + nameLength, "/");
+}
+
+/**
+ *	Closes the descriptor of the shallowest open ancestor of the directory being read,
+ *  saving its read position so traverse_reopen can carry on from there.
+ *
+ *  @return 			description: false if there was none left to close.
+ */
+bool traverse_release(struct traversal *walk){
+	for(int i = 0; i < walk->frameCount - 1; i++){
+		struct traverse_frame *frame = &walk->frames[i];
+		if(frame->fd >= 0){
+			frame->offset = lseek(frame->fd, 0, SEEK_CUR);
+			close(frame->fd);
+			frame->fd = -1;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ *	Opens a directory, closing ancestors while the process is out of descriptors.
+ *  Failures other than the directory having gone away are reported and counted.
+ *
+ *	@param 	name 		description: relative to dirfd, walk->path already names it.
+ *  @return 			description: the descriptor, or -1.
+ */
+int traverse_open(struct traversal *walk, int dirfd, const char *name){
+	int fd;
+	while((fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0){
+		if((errno != EMFILE && errno != ENFILE) || !traverse_release(walk)){
+			break;
+		}
+	}
+	if(fd < 0 && errno != ENOENT){
+		size_t length = strlen(walk->path);
+		if(length > 1 && walk->path[length - 1] == '/'){
+			length--;
+		}
+		fprintf(stderr, "-%s: %.*s: %s\n", sysname, (int)length, length ? walk->path : ".", strerror(errno));
+		walk->errors++;
+	}
+	return fd;
+}
+
+/**
+ *	Opens a directory and pushes its frame.
+ *
+ *  @return 			description: false if it could not be opened.
+ */
+bool traverse_enter(struct traversal *walk, int dirfd, const char *name){
+	int fd = traverse_open(walk, dirfd, name);
+	if(fd < 0){
+		return false;
+	}
+	if(walk->frameCount == walk->frameCapacity){
+		walk->frameCapacity = walk->frameCapacity ? walk->frameCapacity * 2 : 16;
+		walk->frames = realloc(walk->frames, walk->frameCapacity * sizeof(struct traverse_frame));
+		for(int i = walk->frameCount; i < walk->frameCapacity; i++){
+			walk->frames[i].buffer = NULL; // allocated on first use and kept
+		}
+	}
+	struct traverse_frame *frame = &walk->frames[walk->frameCount++];
+	if(frame->buffer == NULL){
+		frame->buffer = malloc(TRAVERSE_BUFFER);
+	}
+	frame->fd = fd;
+	frame->length = frame->position = 0;
+	frame->pathLength = strlen(walk->path);
+	return true;
+}
+
+/**
+ *	Reopens the directory being read after traverse_release closed it, by its path
+ *  from the start of the walk.
+ *
+ *  @return 			description: false if it could not be opened again.
+ */
+bool traverse_reopen(struct traversal *walk){
+	struct traverse_frame *frame = &walk->frames[walk->frameCount - 1];
+	int fd = traverse_open(walk, walk->rootfd, walk->path[0] != '\0' ? walk->path : ".");
+	if(fd < 0){
+		return false;
+	}
+	lseek(fd, frame->offset, SEEK_SET);
+	frame->fd = fd;
+	return true;
+}
+
+/**
+ *	Closes the directory being read and returns to its parent.
+ */
+void traverse_leave(struct traversal *walk){
+	if(walk->frames[--walk->frameCount].fd >= 0){
+		close(walk->frames[walk->frameCount].fd);
+	}
+	if(walk->frameCount > 0){
+		walk->path[walk->frames[walk->frameCount - 1].pathLength] = '\0';
+	}
+}
+
+/**
+ *	Walks the tree below path, calling walk->visit for every entry except . and .. in
+ *  the order getdents64 returns them, depth first. Symbolic links are reported as
+ *  DT_LNK and not followed.
+ *
+ *	@param 	walk 		description: visit, data and maxDepth set, the rest zero or left from an earlier call.
+ *	@param 	dirfd 		description: directory path is relative to, or AT_FDCWD.
+ *	@param 	path 		description: the start directory, "" or "." for dirfd itself.
+ *  @return 			description: -1 if the start directory could not be opened, 1 if visit stopped the walk, 0 otherwise.
+ */
+int traverse(struct traversal *walk, int dirfd, const char *path){
+	if(walk->pathCapacity == 0){
+		walk->pathCapacity = 256;
+		walk->path = malloc(walk->pathCapacity);
+	}
+	walk->path[0] = '\0';
+	if(path[0] != '\0' && strcmp(path, ".") != 0){
+		traverse_path_push(walk, path);
+		if(walk->path[strlen(walk->path) - 2] == '/'){
+			walk->path[strlen(walk->path) - 1] = '\0'; // path already ended in a slash
+		}
+	}
+	walk->frameCount = 0;
+	walk->rootfd = dirfd;
+	if(!traverse_enter(walk, dirfd, path[0] != '\0' ? path : ".")){
+		return -1;
+	}
+
+	int result = 0;
+	while(walk->frameCount > 0){
+		struct traverse_frame *frame = &walk->frames[walk->frameCount - 1];
+		if(frame->fd < 0 && !traverse_reopen(walk)){
+			traverse_leave(walk); // the rest of it is lost
+			continue;
+		}
+		if(frame->position >= frame->length){
+			frame->length = getdents64(frame->fd, frame->buffer, TRAVERSE_BUFFER);
+			frame->position = 0;
+			if(frame->length <= 0){
+				traverse_leave(walk);
+				continue;
+			}
+		}
+
+		struct dirent64 *entry = (struct dirent64 *)(frame->buffer + frame->position);
+		frame->position += entry->d_reclen;
+		const char *name = entry->d_name;
+		if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))){
+			continue;
+		}
+
+		unsigned char type = entry->d_type;
+		if(type == DT_UNKNOWN){
+			struct stat st;
+			if(fstatat(frame->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0){
+				type = IFTODT(st.st_mode);
+			}
+		}
+
+		walk->dirfd = frame->fd;
+		walk->depth = walk->frameCount - 1;
+		enum traverse_result next = walk->visit(walk, name, type);
+		if(next == TRAVERSE_STOP){
+			result = 1;
+			break;
+		}
+		if(next == TRAVERSE_CONTINUE && type == DT_DIR && (walk->maxDepth == 0 || walk->frameCount < walk->maxDepth)){
+			size_t pathLength = strlen(walk->path);
+			traverse_path_push(walk, name);
+			if(!traverse_enter(walk, frame->fd, name)){
+				walk->path[pathLength] = '\0'; // unreadable, or out of descriptors
+			}
+		}
+	}
+
+	while(walk->frameCount > 0){
+		traverse_leave(walk);
+	}
+	return result;
+}
+
+void traverse_free(struct traversal *walk){
+	for(int i = 0; i < walk->frameCapacity; i++){
+		free(walk->frames[i].buffer);
+	}
+	free(walk->frames);
+	free(walk->path);
+	walk->frames = NULL;
+	walk->path = NULL;
+	walk->frameCapacity = 0;
+	walk->pathCapacity = 0;
+}
+
+/*
+ * Parallel directory walker for filesearch -r. Every thread owns a deque of subtrees
+ * still to be walked, as paths relative to the start directory, and walks the one it
+ * takes with the traversal engine. While another thread is waiting for work, the
+ * subdirectories a thread comes across are pushed onto the back of its own deque instead
+ * of being descended into. A thread takes its next subtree from the back of its own
+ * deque, so it stays close to directories that are likely cached; a thread whose deque
+ * is empty steals from the front of another one, where the shallowest and so biggest
+ * subtrees wait. pending counts subtrees queued or being walked, the walk is over when
+ * it drops to zero. Matches are buffered per thread and
+ * written in whole lines, or collected and sorted when the order has to be the same on
+ * every run (-s) or the files are opened afterwards (-o).
+ */
+#define WALK_OUTPUT_FLUSH 65536
+
+struct walk_deque{
+	pthread_mutex_t lock;
+	char **items; // items[head] up to items[tail - 1]
+	size_t head;
+	size_t tail;
+	size_t capacity;
+};
+
+struct walk_output{
+	char *data; // matches, one per line
+	size_t length;
+	size_t capacity;
+};
+
+struct walker{
+	int root; // the start directory
+	bool collect; // keep every match instead of flushing the buffers
+	int threads;
+	struct walk_deque *deques;
+	struct walk_output *outputs;
+	atomic_long pending;
+	atomic_int idle;
+	pthread_mutex_t idleLock; // also serializes writes to stdout
+	pthread_cond_t work;
+};
+
+struct walk_thread{
+	struct walker *walker;
+	int id;
+	struct traversal walk;
+	struct matcher matcher; // a copy each, regexec locks a shared regex_t
+};
+
+void walk_push(struct walker *walker, int id, char *path){
+	struct walk_deque *deque = &walker->deques[id];
+	atomic_fetch_add(&walker->pending, 1);
+	pthread_mutex_lock(&deque->lock);
+	if(deque->tail == deque->capacity){
+		if(deque->head > 0){
+			memmove(deque->items, deque->items + deque->head, (deque->tail - deque->head) * sizeof(char *));
+			deque->tail -= deque->head;
+			deque->head = 0;
+		}else{
+			deque->capacity = deque->capacity ? deque->capacity * 2 : 64;
+			deque->items = realloc(deque->items, deque->capacity * sizeof(char *));
+		}
+	}
+	deque->items[deque->tail++] = path;
+	pthread_mutex_unlock(&deque->lock);
+
+	if(atomic_load(&walker->idle) > 0){
+		pthread_cond_signal(&walker->work);
+	}
+}
+
+/**
+ *	Takes the next directory for thread id: the newest one of its own deque, otherwise
+ *  the oldest one of the first other deque that has any.
+ *
+ *  @return 			description: the path, NULL if every deque is empty.
+ */
+char *walk_take(struct walker *walker, int id){
+	for(int i = 0; i < walker->threads; i++){
+		struct walk_deque *deque = &walker->deques[(id + i) % walker->threads];
+		char *path = NULL;
+		pthread_mutex_lock(&deque->lock);
+		if(deque->head < deque->tail){
+			path = i == 0 ? deque->items[--deque->tail] : deque->items[deque->head++];
+		}
+		pthread_mutex_unlock(&deque->lock);
+		if(path != NULL){
+			return path;
+		}
+	}
+	return NULL;
+}
+
+void walk_emit(struct walker *walker, int id, const char *directory, const char *name){
+	struct walk_output *output = &walker->outputs[id];
+	size_t length = strlen(directory) + strlen(name) + 4;
+	if(output->length + length > output->capacity){
+		output->capacity = output->capacity * 2 + length + WALK_OUTPUT_FLUSH;
+		output->data = realloc(output->data, output->capacity);
+	}
+	output->length += sprintf(output->data + output->length, "./%s%s\n", directory, name);
+
+	if(!walker->collect && output->length >= WALK_OUTPUT_FLUSH){
+		pthread_mutex_lock(&walker->idleLock);
+		fwrite(output->data, 1, output->length, stdout);
+		pthread_mutex_unlock(&walker->idleLock);
+		output->length = 0;
+	}
+}
+
+/**
+ *	Reports an entry if its name matches. A subdirectory is handed to the waiting
+ *  threads when there are any, and walked by this one otherwise.
+ */
+enum traverse_result walk_visit(struct traversal *walk, const char *name, unsigned char type){
+	struct walk_thread *thread = walk->data;
+	struct walker *walker = thread->walker;
+
+	if(matcher_match(&thread->matcher, name)){
+		walk_emit(walker, thread->id, walk->path, name);
+	}
+	if(type != DT_DIR || atomic_load(&walker->idle) == 0){
+		return TRAVERSE_CONTINUE;
+	}
+
+	size_t pathLength = strlen(walk->path), nameLength = strlen(name);
+	char *path = malloc(pathLength + nameLength + 2);
+	memcpy(path, walk->path, pathLength);
+	memcpy(path + pathLength, name, nameLength);
+	strcpy(path + pathLength + nameLength, "/");
+	walk_push(walker, thread->id, path);
+	return TRAVERSE_SKIP;
+}
+
+void *walk_thread(void *argument){
+	struct walk_thread *thread = argument;
+	struct walker *walker = thread->walker;
+
+	for(;;){
+		char *path = walk_take(walker, thread->id);
+		if(path != NULL){
+			traverse(&thread->walk, walker->root, path);
+			free(path);
+			if(atomic_fetch_sub(&walker->pending, 1) == 1){
+				pthread_cond_broadcast(&walker->work); // that was the last one
+			}
+			continue;
+		}
+
+		// nothing to take, wait until someone queues a directory or the walk is over
+		pthread_mutex_lock(&walker->idleLock);
+		if(atomic_load(&walker->pending) == 0){
+			pthread_mutex_unlock(&walker->idleLock);
+			break;
+		}
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += 1000000;
+		if(until.tv_nsec >= 1000000000){
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		// the timeout covers a push that signalled just before this thread started waiting
+		atomic_fetch_add(&walker->idle, 1);
+		pthread_cond_timedwait(&walker->work, &walker->idleLock, &until);
+		atomic_fetch_sub(&walker->idle, 1);
+		pthread_mutex_unlock(&walker->idleLock);
+	}
+	return NULL;
+}
+
+int walk_compare(const void *a, const void *b){
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ *	Prints matches as they are or sorted, opening the regular files among them with
+ *  xdg-open when asked to.
+ *
+ *	@param 	lines 		description: the matches, ./path each.
+ */
+void filesearch_print(char **lines, size_t count, bool open, bool sorted){
+	if(sorted){
+		qsort(lines, count, sizeof(char *), walk_compare);
+	}
+	for(size_t i = 0; i < count; i++){
+		printf("%s\n", lines[i]);
+		struct stat path_stats;
+		if(open && stat(lines[i], &path_stats) == 0 && S_ISREG(path_stats.st_mode)){
+			filesearch_open(lines[i]);
+		}
+	}
+}
+
+/**
+ *	Searches the tree below the current directory for names the matcher accepts and
+ *  prints them as ./path, opening the regular files with xdg-open when asked to.
+ *
+ *	@param 	matcher 	description: compiled from the name searched for.
+ *	@param 	open 		description: open the regular files found.
+ *	@param 	sorted 		description: print in sorted order instead of as found.
+ *	@param 	threads 	description: number of threads, 0 for one per online CPU.
+ */
+void recursiveFileSearch(const struct matcher *matcher, bool open, bool sorted, int threads){
+	struct walker walker = {.collect = sorted || open};
+	walker.root = openat(AT_FDCWD, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC); // open is the flag here
+	if(walker.root < 0){
+		printf("-%s: filesearch: %s\n", sysname, strerror(errno));
+		return;
+	}
+	walker.threads = threads > 0 ? threads : sysconf(_SC_NPROCESSORS_ONLN);
+	if(walker.threads < 1){
+		walker.threads = 1;
+	}
+	walker.deques = calloc(walker.threads, sizeof(struct walk_deque));
+	walker.outputs = calloc(walker.threads, sizeof(struct walk_output));
+	struct walk_thread *workers = calloc(walker.threads, sizeof(struct walk_thread));
+	pthread_t *ids = calloc(walker.threads, sizeof(pthread_t));
+	pthread_mutex_init(&walker.idleLock, NULL);
+	pthread_cond_init(&walker.work, NULL);
+	for(int i = 0; i < walker.threads; i++){
+		pthread_mutex_init(&walker.deques[i].lock, NULL);
+		workers[i] = (struct walk_thread){.walker = &walker, .id = i};
+		workers[i].walk.visit = walk_visit;
+		workers[i].walk.data = &workers[i];
+		char error[256]; // the pattern compiled once already
+		matcher_init(&workers[i].matcher, matcher->pattern, matcher->flags, error, sizeof(error));
+	}
+
+	walk_push(&walker, 0, strdup(""));
+	int started = 1;
+	for(; started < walker.threads; started++){
+		if(pthread_create(&ids[started], NULL, walk_thread, &workers[started]) != 0){
+			break; // the others share the work
+		}
+	}
+	walk_thread(&workers[0]);
+	for(int i = 1; i < started; i++){
+		pthread_join(ids[i], NULL);
+	}
+	close(walker.root);
+
+	fflush(stdout);
+	if(!walker.collect){
+		for(int i = 0; i < walker.threads; i++){
+			fwrite(walker.outputs[i].data, 1, walker.outputs[i].length, stdout);
+		}
+	}else{
+		size_t count = 0, capacity = 0;
+		char **lines = NULL;
+		for(int i = 0; i < walker.threads; i++){
+			struct walk_output *output = &walker.outputs[i];
+			char *line = output->data, *end = output->data + output->length, *newline;
+			for(; line < end && (newline = memchr(line, '\n', end - line)) != NULL; line = newline + 1){
+				if(count == capacity){
+					capacity = capacity ? capacity * 2 : 256;
+					lines = realloc(lines, capacity * sizeof(char *));
+				}
+				lines[count++] = line;
+				*newline = '\0';
+			}
+		}
+		filesearch_print(lines, count, open, sorted);
+		free(lines);
+	}
+
+	for(int i = 0; i < walker.threads; i++){
+		if(workers[i].walk.errors > 0){
+			last_status = 1; // part of the tree could not be read
+		}
+		traverse_free(&workers[i].walk);
+		matcher_free(&workers[i].matcher);
+		pthread_mutex_destroy(&walker.deques[i].lock);
+		free(walker.deques[i].items);
+		free(walker.outputs[i].data);
+	}
+	pthread_mutex_destroy(&walker.idleLock);
+	pthread_cond_destroy(&walker.work);
+	free(walker.deques);
+	free(walker.outputs);
+	free(workers);
+	free(ids);
+}
+
+/*
+ * Filename index for filesearch -I. filesearch --index-build walks the current
+ * directory once and writes an index of it to $SHELLFYRE_INDEX_DIR (~/.cache/shellfyre
+ * by default), one file per root directory; filesearch --index-watch starts a background
+ * updater that keeps it current from inotify events, --index-stop ends that again.
+ *
+ * Every file or directory is an entry that holds its parent entry and its name, so a
+ * path component is stored once however many entries sit below it, and equal names share
+ * one copy in the name pool. The entries are also listed sorted by name, for shell
+ * patterns that start with a literal prefix. Every lower-cased trigram of a name has a
+ * posting list of the entries containing it, so a substring query only checks the
+ * entries on the list of its rarest trigram. filesearch -I maps the file read only.
+ *
+ * The updater keeps the tree in memory, with a watch on every directory. An event adds
+ * or removes one entry, or walks just the directory that appeared. Once no event came
+ * for INDEX_QUIET_MS, or at the latest INDEX_MAX_DELAY_MS after the first change, it
+ * writes the index to a temporary file and renames that over the old one. The updater
+ * holds an exclusive flock on the index's lock file while it runs. An index the running
+ * updater wrote with a watch on every directory is current. The index also records the
+ * modification time of every directory as it was when the directory was read, and an
+ * index --index-build wrote is current while every directory still has it and it is not
+ * older than SHELLFYRE_INDEX_MAX_AGE seconds (300). Any other index is stale, that of an
+ * updater that has stopped included, and filesearch -I walks the tree instead.
+ */
+#define INDEX_MAGIC "SFINDEX3"
+#define INDEX_NONE UINT32_MAX // parent of the entries directly in the root
+#define INDEX_GONE (UINT32_MAX - 1) // a removed table slot, a removed watch
+#define INDEX_QUIET_MS 500
+#define INDEX_MAX_DELAY_MS 2000
+#define INDEX_RACY_NS 100000000LL // a directory changed this recently may change again unseen
+
+struct index_header
+{
+	char magic[8];
+	int64_t built; // seconds since the epoch
+	uint64_t size; // of the whole file, a shorter one is torn
+	uint32_t entryCount;
+	uint32_t trigramCount;
+	uint32_t updater;	// 1 if written by the updater
+	uint32_t unwatched; // directories the updater could not watch, changes there are missed
+	uint32_t directoryCount;
+	uint64_t entries;  // offset of struct index_entry[entryCount]
+	uint64_t names;	   // offset of the name pool
+	uint64_t sorted;   // offset of uint32_t[entryCount], entry numbers sorted by name
+	uint64_t trigrams; // offset of struct index_trigram[trigramCount], sorted by trigram
+	uint64_t postings; // offset of the uint32_t entry numbers the trigrams point into
+	uint64_t directories; // offset of struct index_directory[directoryCount]
+	char root[4096];
+};
+
+struct index_entry
+{
+	uint32_t parent;
+	uint32_t name; // offset in the name pool
+};
 
-		code = process_command(command);
-		if (code == EXIT)
+struct index_directory
+{
+	int64_t modified; // nanoseconds since the epoch, -1 if unknown or changing while read
+	uint32_t entry;	  // INDEX_NONE for the root
+};
+
+struct index_trigram
+{
+	uint32_t trigram;
+	uint32_t offset; // first posting
+	uint32_t count;
+};
+
+struct index_node
+{
+	uint32_t parent;
+	bool dead; // removed, as is everything below it
+	char *name;
+	int64_t modified; // of a directory when it was read, see index_modified; 0 for other entries
+};
+
+// the tree the builder and the updater keep in memory
+struct index_tree
+{
+	struct index_node *nodes; // a parent always comes before its children
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t *slots; // open addressing table of live nodes by parent and name
+	uint32_t slotCount;
+	uint32_t slotsUsed; // including the removed ones
+	uint32_t live;
+	int inotify;	   // -1 when only building
+	uint32_t *byWatch; // directory node of each watch descriptor
+	int watchCapacity;
+	uint32_t unwatched; // out of watches for these directories
+	int64_t rootModified;
+};
+
+uint64_t index_hash(const char *text, uint64_t hash){
+	for(; *text != '\0'; text++){
+		hash = (hash ^ (unsigned char)*text) * 1099511628211ULL; // FNV-1a
+	}
+	return hash;
+}
+
+/**
+ *	Works out the index file of a root directory.
+ *
+ *  @return 			description: false if there is neither SHELLFYRE_INDEX_DIR nor HOME.
+ */
+bool index_file(const char *root, char *file, size_t size){
+	const char *directory = getenv("SHELLFYRE_INDEX_DIR");
+	const char *home = getenv("HOME");
+	char cache[4096];
+	if(directory == NULL){
+		if(home == NULL){
+			return false;
+		}
+		snprintf(cache, sizeof(cache), "%s/.cache", home);
+		mkdir(cache, 0755);
+		snprintf(cache, sizeof(cache), "%s/.cache/shellfyre", home);
+		mkdir(cache, 0755);
+		directory = cache;
+	}
+	snprintf(file, size, "%s/index-%016llx", directory, (unsigned long long)index_hash(root, 14695981039346656037ULL));
+	return true;
+}
+
+uint32_t *index_slot(struct index_tree *tree, uint32_t parent, const char *name){
+	uint32_t mask = tree->slotCount - 1;
+	uint32_t slot = index_hash(name, 14695981039346656037ULL ^ parent) & mask;
+	for(; tree->slots[slot] != INDEX_NONE; slot = (slot + 1) & mask){
+		if(tree->slots[slot] == INDEX_GONE){
+			continue;
+		}
+		struct index_node *node = &tree->nodes[tree->slots[slot]];
+		if(node->parent == parent && strcmp(node->name, name) == 0){
 			break;
+		}
+	}
+	return &tree->slots[slot];
+}
+
+uint32_t index_find(struct index_tree *tree, uint32_t parent, const char *name){
+	return tree->slotCount ? *index_slot(tree, parent, name) : INDEX_NONE;
+}
+
+/**
+ *	Rebuilds the table at a size that leaves room for as many live nodes again,
+ *  dropping the removed slots.
+ */
+void index_rehash(struct index_tree *tree){
+	free(tree->slots);
+	for(tree->slotCount = 1024; tree->slotCount < 4 * tree->live;){
+		tree->slotCount *= 2;
+	}
+	tree->slots = malloc(tree->slotCount * sizeof(uint32_t));
+	memset(tree->slots, 0xff, tree->slotCount * sizeof(uint32_t));
+	tree->slotsUsed = 0;
+	for(uint32_t i = 0; i < tree->count; i++){
+		if(!tree->nodes[i].dead){
+			*index_slot(tree, tree->nodes[i].parent, tree->nodes[i].name) = i;
+			tree->slotsUsed++;
+		}
+	}
+}
+
+/**
+ *	Adds an entry unless it is there already.
+ *
+ *  @return 			description: the node of the entry.
+ */
+uint32_t index_add(struct index_tree *tree, uint32_t parent, const char *name){
+	uint32_t found = index_find(tree, parent, name);
+	if(found != INDEX_NONE){
+		return found;
+	}
+	if(tree->count == tree->capacity){
+		tree->capacity = tree->capacity ? tree->capacity * 2 : 4096;
+		tree->nodes = realloc(tree->nodes, tree->capacity * sizeof(struct index_node));
+	}
+	uint32_t id = tree->count++;
+	tree->nodes[id] = (struct index_node){.parent = parent, .name = strdup(name)};
+	tree->live++;
+	if(2 * (tree->slotsUsed + 1) > tree->slotCount){
+		index_rehash(tree); // takes the new node along
+	}else{
+		*index_slot(tree, parent, name) = id;
+		tree->slotsUsed++;
+	}
+	return id;
+}
+
+/**
+ *	Removes an entry, and with it everything below it.
+ */
+void index_remove(struct index_tree *tree, uint32_t parent, const char *name){
+	if(tree->slotCount == 0){
+		return;
+	}
+	uint32_t *slot = index_slot(tree, parent, name);
+	if(*slot == INDEX_NONE){
+		return;
+	}
+	tree->nodes[*slot].dead = true;
+	tree->live--;
+	*slot = INDEX_GONE; // emptying it would cut the probe chains running through it
+}
+
+bool index_alive(struct index_tree *tree, uint32_t id){
+	for(; id != INDEX_NONE; id = tree->nodes[id].parent){
+		if(tree->nodes[id].dead){
+			return false;
+		}
+	}
+	return true;
+}
+
+void index_watch_directory(struct index_tree *tree, const char *path, uint32_t id){
+	if(tree->inotify < 0){
+		return;
+	}
+	int wd = inotify_add_watch(tree->inotify, path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK);
+	if(wd < 0){
+		tree->unwatched += errno == ENOSPC || errno == ENOMEM || errno == ENAMETOOLONG; // the index can miss changes
+		return;
+	}
+	if(wd >= tree->watchCapacity){
+		int capacity = tree->watchCapacity;
+		tree->watchCapacity = wd * 2 + 64;
+		tree->byWatch = realloc(tree->byWatch, tree->watchCapacity * sizeof(uint32_t));
+		memset(tree->byWatch + capacity, 0xff, (tree->watchCapacity - capacity) * sizeof(uint32_t));
+	}
+	tree->byWatch[wd] = id;
+}
+
+struct index_walk
+{
+	struct index_tree *tree;
+	uint32_t base;		// directory the walk started in
+	uint32_t *directories; // node of the directory being read at each depth
+	int depth;
+};
+
+/**
+ *	The modification time of a directory about to be read, in nanoseconds, or -1 if it
+ *  changed so recently that a change after the read could leave the time as it is.
+ */
+int64_t index_modified(const struct stat *st){
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	int64_t modified = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+	return now.tv_sec * 1000000000LL + now.tv_nsec - modified < INDEX_RACY_NS ? -1 : modified;
+}
+
+enum traverse_result index_visit(struct traversal *walk, const char *name, unsigned char type){
+	struct index_walk *state = walk->data;
+	uint32_t parent = walk->depth == 0 ? state->base : state->directories[walk->depth - 1];
+	uint32_t id = index_add(state->tree, parent, name);
+	if(type == DT_DIR){
+		if(walk->depth >= state->depth){
+			state->depth = walk->depth * 2 + 16;
+			state->directories = realloc(state->directories, state->depth * sizeof(uint32_t));
+		}
+		state->directories[walk->depth] = id;
+
+		// watched and timed before it is read, so nothing created meanwhile is missed
+		struct stat st;
+		state->tree->nodes[id].modified = fstatat(walk->dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 ? index_modified(&st) : -1;
+		if(state->tree->inotify >= 0){
+			size_t pathLength = strlen(walk->path), nameLength = strlen(name);
+			char *path = malloc(pathLength + nameLength + 1);
+			memcpy(path, walk->path, pathLength);
+			memcpy(path + pathLength, name, nameLength + 1);
+			index_watch_directory(state->tree, path, id);
+			free(path);
+		}
+	}
+	return TRAVERSE_CONTINUE;
+}
+
+/**
+ *	Adds everything below a directory to the tree.
+ *
+ *	@param 	path 	description: the directory, relative to the root, which is the current directory.
+ *	@param 	id 		description: its node, INDEX_NONE for the root.
+ *  @return 		description: the number of directories that could not be read.
+ */
+int index_walk(struct index_tree *tree, const char *path, uint32_t id){
+	struct index_walk state = {.tree = tree, .base = id};
+	struct traversal walk = {.visit = index_visit, .data = &state};
+	index_watch_directory(tree, path, id);
+	struct stat st;
+	int64_t modified = stat(path, &st) == 0 ? index_modified(&st) : -1;
+	if(id == INDEX_NONE){
+		tree->rootModified = modified;
+	}else{
+		tree->nodes[id].modified = modified;
+	}
+	traverse(&walk, AT_FDCWD, path);
+	traverse_free(&walk);
+	free(state.directories);
+	return walk.errors;
+}
+
+/**
+ *	Builds the ./ path of a node relative to the root, as long as it needs to be.
+ *
+ *  @return 			description: the path, to be freed.
+ */
+char *index_node_path(struct index_tree *tree, uint32_t id){
+	size_t length = 1;
+	for(uint32_t node = id; node != INDEX_NONE; node = tree->nodes[node].parent){
+		length += 1 + strlen(tree->nodes[node].name);
+	}
+
+	// built backwards from the node to the root
+	char *path = malloc(length + 1);
+	size_t at = length;
+	path[at] = '\0';
+	for(uint32_t node = id; node != INDEX_NONE; node = tree->nodes[node].parent){
+		size_t nameLength = strlen(tree->nodes[node].name);
+		at -= nameLength;
+		memcpy(path + at, tree->nodes[node].name, nameLength);
+		path[--at] = '/';
+	}
+	path[0] = '.';
+	return path;
+}
+
+struct index_names
+{
+	const struct index_entry *entries;
+	const char *pool;
+};
+
+int index_compare_names(const void *a, const void *b, void *names){
+	const struct index_names *list = names;
+	return strcmp(list->pool + list->entries[*(const uint32_t *)a].name, list->pool + list->entries[*(const uint32_t *)b].name);
+}
+
+int index_compare_postings(const void *a, const void *b){
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+uint32_t index_trigram_of(const char *text){
+	return (uint32_t)tolower((unsigned char)text[0]) << 16 | (uint32_t)tolower((unsigned char)text[1]) << 8 | (uint32_t)tolower((unsigned char)text[2]);
+}
+
+/**
+ *	Writes the live part of the tree as an index, through a temporary file renamed over
+ *  the old index.
+ */
+bool index_write(struct index_tree *tree, const char *root, const char *file){
+	uint32_t *renumber = malloc((tree->count + 1) * sizeof(uint32_t));
+	struct index_entry *entries = malloc((tree->count + 1) * sizeof(struct index_entry));
+	uint32_t count = 0;
+
+	// names: each distinct one once, found through a table of pool offsets
+	size_t poolLength = 0, poolCapacity = 65536;
+	char *pool = malloc(poolCapacity);
+	uint32_t tableSize = 1024;
+	while(tableSize < 2 * tree->count){
+		tableSize *= 2;
+	}
+	uint32_t *table = malloc(tableSize * sizeof(uint32_t));
+	memset(table, 0xff, tableSize * sizeof(uint32_t));
+
+	size_t postingCount = 0, postingCapacity = 65536;
+	uint64_t *postings = malloc(postingCapacity * sizeof(uint64_t));
+
+	// the directories with the times they were read at, the root first
+	uint32_t directoryCount = 1, directoryCapacity = 1024;
+	struct index_directory *directories = calloc(directoryCapacity, sizeof(struct index_directory));
+	directories[0] = (struct index_directory){.modified = tree->rootModified, .entry = INDEX_NONE};
+
+	for(uint32_t i = 0; i < tree->count; i++){
+		struct index_node *node = &tree->nodes[i];
+		uint32_t parent = node->parent == INDEX_NONE ? INDEX_NONE : renumber[node->parent];
+		if(node->dead || (node->parent != INDEX_NONE && parent == INDEX_NONE)){
+			renumber[i] = INDEX_NONE;
+			continue;
+		}
+
+		uint32_t slot = index_hash(node->name, 14695981039346656037ULL) & (tableSize - 1);
+		while(table[slot] != INDEX_NONE && strcmp(pool + table[slot], node->name) != 0){
+			slot = (slot + 1) & (tableSize - 1);
+		}
+		if(table[slot] == INDEX_NONE){
+			size_t length = strlen(node->name) + 1;
+			if(poolLength + length > poolCapacity){
+				poolCapacity = (poolLength + length) * 2;
+				pool = realloc(pool, poolCapacity);
+			}
+			memcpy(pool + poolLength, node->name, length);
+			table[slot] = poolLength;
+			poolLength += length;
+		}
+		renumber[i] = count;
+		entries[count] = (struct index_entry){.parent = parent, .name = table[slot]};
+		if(node->modified != 0){
+			if(directoryCount == directoryCapacity){
+				directories = realloc(directories, directoryCapacity * 2 * sizeof(struct index_directory));
+				memset(directories + directoryCapacity, 0, directoryCapacity * sizeof(struct index_directory));
+				directoryCapacity *= 2;
+			}
+			directories[directoryCount++] = (struct index_directory){.modified = node->modified, .entry = count};
+		}
+
+		size_t length = strlen(node->name);
+		for(size_t j = 0; j + 3 <= length; j++){
+			if(postingCount == postingCapacity){
+				postingCapacity *= 2;
+				postings = realloc(postings, postingCapacity * sizeof(uint64_t));
+			}
+			postings[postingCount++] = (uint64_t)index_trigram_of(node->name + j) << 32 | count;
+		}
+		count++;
+	}
+	free(table);
+	free(renumber);
+
+	uint32_t *sorted = malloc((count + 1) * sizeof(uint32_t));
+	for(uint32_t i = 0; i < count; i++){
+		sorted[i] = i;
+	}
+	struct index_names sortNames = {.entries = entries, .pool = pool};
+	qsort_r(sorted, count, sizeof(uint32_t), index_compare_names, &sortNames);
+
+	// one posting per trigram and entry, grouped by trigram with the entries ascending
+	qsort(postings, postingCount, sizeof(uint64_t), index_compare_postings);
+	uint32_t *postingIds = malloc((postingCount + 1) * sizeof(uint32_t));
+	struct index_trigram *trigrams = malloc((postingCount + 1) * sizeof(struct index_trigram));
+	uint32_t trigramCount = 0, postingIdCount = 0;
+	for(size_t i = 0; i < postingCount; i++){
+		uint32_t trigram = postings[i] >> 32, id = (uint32_t)postings[i];
+		if(trigramCount == 0 || trigrams[trigramCount - 1].trigram != trigram){
+			trigrams[trigramCount++] = (struct index_trigram){.trigram = trigram, .offset = postingIdCount};
+		}else if(postingIds[postingIdCount - 1] == id){
+			continue; // the trigram occurs twice in the name
+		}
+		postingIds[postingIdCount++] = id;
+		trigrams[trigramCount - 1].count++;
+	}
+	free(postings);
+
+	struct index_header header = {.magic = INDEX_MAGIC, .built = time(NULL), .entryCount = count, .trigramCount = trigramCount,
+								  .updater = tree->inotify >= 0, .unwatched = tree->unwatched, .directoryCount = directoryCount};
+	snprintf(header.root, sizeof(header.root), "%s", root);
+	pool = realloc(pool, poolLength + 8);
+	memset(pool + poolLength, 0, 8);
+	poolLength = (poolLength + 7) & ~(size_t)7; // the sections after it stay aligned
+	header.entries = sizeof(header);
+	header.names = header.entries + (uint64_t)count * sizeof(struct index_entry);
+	header.sorted = header.names + poolLength;
+	header.trigrams = header.sorted + (((uint64_t)count * sizeof(uint32_t) + 7) & ~7ULL);
+	header.postings = header.trigrams + (uint64_t)trigramCount * sizeof(struct index_trigram);
+	header.directories = header.postings + (((uint64_t)postingIdCount * sizeof(uint32_t) + 7) & ~7ULL);
+	header.size = header.directories + (uint64_t)directoryCount * sizeof(struct index_directory);
+
+	char temporary[4096 + 32];
+	snprintf(temporary, sizeof(temporary), "%.4000s.%d", file, getpid());
+	FILE *fd = fopen(temporary, "w");
+	bool written = false;
+	if(fd != NULL){
+		static const char padding[8];
+		fwrite(&header, sizeof(header), 1, fd);
+		fwrite(entries, sizeof(struct index_entry), count, fd);
+		fwrite(pool, 1, poolLength, fd);
+		fwrite(sorted, sizeof(uint32_t), count, fd);
+		fwrite(padding, 1, header.trigrams - header.sorted - (uint64_t)count * sizeof(uint32_t), fd);
+		fwrite(trigrams, sizeof(struct index_trigram), trigramCount, fd);
+		fwrite(postingIds, sizeof(uint32_t), postingIdCount, fd);
+		fwrite(padding, 1, header.directories - header.postings - (uint64_t)postingIdCount * sizeof(uint32_t), fd);
+		fwrite(directories, sizeof(struct index_directory), directoryCount, fd);
+		written = fclose(fd) == 0 && rename(temporary, file) == 0;
+		if(!written){
+			unlink(temporary);
+		}
+	}
+	free(entries);
+	free(pool);
+	free(sorted);
+	free(trigrams);
+	free(postingIds);
+	free(directories);
+	return written;
+}
+
+void index_tree_free(struct index_tree *tree){
+	for(uint32_t i = 0; i < tree->count; i++){
+		free(tree->nodes[i].name);
+	}
+	free(tree->nodes);
+	free(tree->slots);
+	free(tree->byWatch);
+	*tree = (struct index_tree){.inotify = tree->inotify};
+}
+
+/**
+ *	The updater: writes the index once, then applies the inotify events to the tree and
+ *  writes it again after each burst of changes. Runs until it is killed or the root
+ *  goes away.
+ */
+void index_watch(const char *root, const char *file){
+	struct index_tree tree = {.inotify = inotify_init1(IN_CLOEXEC)};
+	if(tree.inotify < 0 || chdir(root) == -1){
+		return;
+	}
+	index_walk(&tree, ".", INDEX_NONE);
+	index_write(&tree, root, file);
+
+	char buffer[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+	long long dirtySince = 0;
+	for(;;){
+		int timeout = -1;
+		if(dirtySince != 0){
+			long long left = INDEX_MAX_DELAY_MS - (now_ns() - dirtySince) / 1000000;
+			timeout = left < 0 ? 0 : left < INDEX_QUIET_MS ? left : INDEX_QUIET_MS;
+		}
+		struct pollfd events = {.fd = tree.inotify, .events = POLLIN};
+		int ready = poll(&events, 1, timeout);
+		if(ready == -1 && errno == EINTR){
+			continue;
+		}
+		if(ready <= 0){
+			index_write(&tree, root, file);
+			dirtySince = 0;
+			continue;
+		}
+
+		ssize_t length = read(tree.inotify, buffer, sizeof(buffer));
+		if(length <= 0){
+			continue;
+		}
+		for(char *at = buffer; at < buffer + length;){
+			struct inotify_event *event = (struct inotify_event *)at;
+			at += sizeof(struct inotify_event) + event->len;
+
+			if(event->mask & IN_Q_OVERFLOW){
+				// events were lost, start over
+				index_tree_free(&tree);
+				close(tree.inotify);
+				tree.inotify = inotify_init1(IN_CLOEXEC);
+				index_walk(&tree, ".", INDEX_NONE);
+				dirtySince = now_ns();
+				break; // the rest came from the old descriptor
+			}else if(event->mask & IN_IGNORED){
+				if(event->wd < tree.watchCapacity && tree.byWatch[event->wd] == INDEX_NONE){
+					return; // the root itself is gone
+				}
+				if(event->wd < tree.watchCapacity){
+					tree.byWatch[event->wd] = INDEX_GONE;
+				}
+				continue;
+			}else if(event->len > 0 && event->wd < tree.watchCapacity && tree.byWatch[event->wd] != INDEX_GONE){
+				uint32_t parent = tree.byWatch[event->wd];
+				if(parent != INDEX_NONE && !index_alive(&tree, parent)){
+					continue;
+				}
+				if(event->mask & (IN_DELETE | IN_MOVED_FROM)){
+					index_remove(&tree, parent, event->name);
+				}else if(event->mask & (IN_CREATE | IN_MOVED_TO)){
+					uint32_t id = index_add(&tree, parent, event->name);
+					if(event->mask & IN_ISDIR){
+						char *path = index_node_path(&tree, id);
+						index_walk(&tree, path, id);
+						free(path);
+					}
+				}
+			}
+			if(dirtySince == 0){
+				dirtySince = now_ns();
+			}
+		}
+	}
+}
+
+/**
+ *	Builds the ./ path of an entry of a mapped index, as long as it needs to be. A parent
+ *  always has a lower number than its children, an index where it does not is damaged.
+ *
+ *  @return 			description: the path to be freed, NULL for a damaged index.
+ */
+char *index_entry_path(const struct index_header *header, uint32_t id){
+	const char *base = (const char *)header;
+	const struct index_entry *entries = (const void *)(base + header->entries);
+	const char *names = base + header->names;
+
+	size_t length = 1;
+	for(uint32_t node = id; node != INDEX_NONE; node = entries[node].parent){
+		if(entries[node].parent != INDEX_NONE && entries[node].parent >= node){
+			return NULL;
+		}
+		length += 1 + strlen(names + entries[node].name);
+	}
+
+	// built backwards from the entry to the root
+	char *path = malloc(length + 1);
+	size_t at = length;
+	path[at] = '\0';
+	for(uint32_t node = id; node != INDEX_NONE; node = entries[node].parent){
+		const char *name = names + entries[node].name;
+		size_t nameLength = strlen(name);
+		at -= nameLength;
+		memcpy(path + at, name, nameLength);
+		path[--at] = '/';
+	}
+	path[0] = '.';
+	return path;
+}
+
+/**
+ *	Checks that every directory of a mapped index still has the modification time it had
+ *  when it was read, so that nothing was added to it or removed from it since.
+ */
+bool index_unchanged(const struct index_header *header){
+	const struct index_directory *directories = (const void *)((const char *)header + header->directories);
+	for(uint32_t i = 0; i < header->directoryCount; i++){
+		if(directories[i].entry != INDEX_NONE && directories[i].entry >= header->entryCount){
+			return false;
+		}
+		char *path = index_entry_path(header, directories[i].entry);
+		struct stat st;
+		bool same = path != NULL && lstat(path, &st) == 0 && S_ISDIR(st.st_mode) &&
+					st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec == directories[i].modified;
+		free(path);
+		if(!same){
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ *	Maps the index of the current directory, if there is one that is current.
+ *
+ *	@param 	header 		description: receives the mapping.
+ *  @return 			description: the size of the mapping, 0 if there is no current index.
+ */
+size_t index_map(const struct index_header **header){
+	char root[4096], file[4096];
+	if(getcwd(root, sizeof(root)) == NULL || !index_file(root, file, sizeof(file))){
+		return 0;
+	}
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if(fd < 0){
+		return 0;
+	}
+	if(fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct index_header)){
+		close(fd);
+		return 0;
+	}
+	const struct index_header *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED){
+		return 0;
+	}
+
+	// an updater holds the lock while it runs; only its own index with every directory
+	// watched is current, other failures to take the lock say nothing about it
+	int lockFd = -1;
+	bool watched = !shared_file_lock(file, &lockFd, LOCK_SH | LOCK_NB) && lockFd >= 0 && errno == EWOULDBLOCK;
+	watched = watched && map->updater && map->unwatched == 0;
+	if(lockFd >= 0){
+		close(lockFd);
+	}
+	const char *maxAge = getenv("SHELLFYRE_INDEX_MAX_AGE");
+	long long age = time(NULL) - map->built;
+	bool valid = memcmp(map->magic, INDEX_MAGIC, sizeof(map->magic)) == 0 && map->size == (uint64_t)st.st_size && strcmp(map->root, root) == 0 &&
+				 map->directories + (uint64_t)map->directoryCount * sizeof(struct index_directory) <= map->size;
+
+	// one an updater no longer keeps current is stale, it did not keep the times either
+	if(!valid || (!watched && (map->updater || age > (maxAge != NULL ? atoll(maxAge) : 300) || !index_unchanged(map)))){
+		munmap((void *)map, st.st_size);
+		return 0;
+	}
+	*header = map;
+	return st.st_size;
+}
+
+/**
+ *	Answers filesearch -I from the index of the current directory.
+ *
+ *  @return 			description: false if there is no current index, the caller walks the tree then.
+ */
+bool index_search(const struct matcher *matcher, bool open, bool sorted){
+	const struct index_header *header;
+	size_t size = index_map(&header);
+	if(size == 0){
+		return false;
+	}
+	const char *base = (const char *)header;
+	const struct index_entry *entries = (const void *)(base + header->entries);
+	const char *names = base + header->names;
+	const uint32_t *byName = (const void *)(base + header->sorted);
+	const struct index_trigram *trigrams = (const void *)(base + header->trigrams);
+	const uint32_t *postings = (const void *)(base + header->postings);
+
+	// candidates: the rarest trigram's list, a range of the sorted names or everything
+	const uint32_t *candidates = NULL;
+	size_t candidateCount = header->entryCount;
+	if((matcher->flags & (MATCH_GLOB | MATCH_REGEX)) == 0 && matcher->length >= 3){
+		candidateCount = 0;
+		candidates = postings;
+		for(size_t i = 0; i + 3 <= matcher->length; i++){
+			uint32_t trigram = index_trigram_of(matcher->pattern + i);
+			size_t low = 0, high = header->trigramCount;
+			while(low < high){
+				size_t middle = (low + high) / 2;
+				if(trigrams[middle].trigram < trigram){
+					low = middle + 1;
+				}else{
+					high = middle;
+				}
+			}
+			if(low == header->trigramCount || trigrams[low].trigram != trigram){
+				candidateCount = 0; // no name has it
+				break;
+			}
+			if(i == 0 || trigrams[low].count < candidateCount){
+				candidates = postings + trigrams[low].offset;
+				candidateCount = trigrams[low].count;
+			}
+		}
+	}else if((matcher->flags & (MATCH_GLOB | MATCH_IGNORE_CASE)) == MATCH_GLOB){
+		size_t prefix = strcspn(matcher->pattern, "*?[\\");
+		size_t low = 0, high = header->entryCount;
+		while(low < high){
+			size_t middle = (low + high) / 2;
+			if(strncmp(names + entries[byName[middle]].name, matcher->pattern, prefix) < 0){
+				low = middle + 1;
+			}else{
+				high = middle;
+			}
+		}
+		size_t end = low;
+		while(end < header->entryCount && strncmp(names + entries[byName[end]].name, matcher->pattern, prefix) == 0){
+			end++;
+		}
+		candidates = byName + low;
+		candidateCount = end - low;
+	}
+
+	size_t count = 0, capacity = 0;
+	char **lines = NULL;
+	for(size_t i = 0; i < candidateCount; i++){
+		uint32_t id = candidates != NULL ? candidates[i] : i;
+		if(!matcher_match(matcher, names + entries[id].name)){
+			continue;
+		}
+
+		char *path = index_entry_path(header, id);
+		if(path == NULL){
+			continue;
+		}
+		if(count == capacity){
+			capacity = capacity ? capacity * 2 : 256;
+			lines = realloc(lines, capacity * sizeof(char *));
+		}
+		lines[count++] = path;
+	}
+	munmap((void *)header, size);
+
+	filesearch_print(lines, count, open, sorted);
+	for(size_t i = 0; i < count; i++){
+		free(lines[i]);
+	}
+	free(lines);
+	return true;
+}
+
+/**
+ *	filesearch --index-build, --index-watch and --index-stop, for the current directory.
+ */
+int index_command(struct command_t *command){
+	const char *option = command->args[0];
+	char root[4096], file[4096];
+	if(getcwd(root, sizeof(root)) == NULL || !index_file(root, file, sizeof(file))){
+		printf("-%s: %s: no directory for the index\n", sysname, command->name);
+		last_status = 1;
+		return SUCCESS;
+	}
+
+	int lockFd = -1;
+	if(strcmp(option, "--index-build") == 0){
+		struct index_tree tree = {.inotify = -1};
+		if(index_walk(&tree, ".", INDEX_NONE) > 0){
+			last_status = 1; // written all the same, without what could not be read
+		}
+		if(!index_write(&tree, root, file)){
+			printf("-%s: %s: %s: %s\n", sysname, command->name, file, strerror(errno));
+			last_status = 1;
+		}
+		index_tree_free(&tree);
+	}else if(strcmp(option, "--index-stop") == 0){
+		// the pid in the lock file is only the updater's while the lock is held
+		char pid[32] = "";
+		if(shared_file_lock(file, &lockFd, LOCK_SH | LOCK_NB) || lockFd < 0 || pread(lockFd, pid, sizeof(pid) - 1, 0) <= 0 || atoi(pid) <= 0 || kill(atoi(pid), SIGTERM) == -1){
+			printf("-%s: %s: no updater running\n", sysname, command->name);
+			last_status = 1;
+		}
+		if(lockFd >= 0){
+			close(lockFd);
+		}
+	}else if(strcmp(option, "--index-watch") != 0){
+		printf("Usage: filesearch --index-build | --index-watch | --index-stop\n");
+	}else if(!shared_file_lock(file, &lockFd, LOCK_EX | LOCK_NB)){
+		printf("-%s: %s: an updater is running already\n", sysname, command->name);
+		last_status = 1;
+		if(lockFd >= 0){
+			close(lockFd);
+		}
+	}else{
+		// detached: the shell only waits for the first child, the updater is adopted by init
+		pid_t pid = fork();
+		if(pid == 0){
+			if(fork() != 0){
+				_exit(0);
+			}
+			setsid();
+			sigset_t none;
+			sigemptyset(&none);
+			sigprocmask(SIG_SETMASK, &none, NULL);
+			signal(SIGTERM, SIG_DFL);
+			signal(SIGINT, SIG_IGN);
+			int null = open("/dev/null", O_RDWR);
+			dup2(null, STDIN_FILENO);
+			dup2(null, STDOUT_FILENO);
+			dup2(null, STDERR_FILENO);
+
+			char pidText[32];
+			int length = snprintf(pidText, sizeof(pidText), "%d\n", getpid());
+			ftruncate(lockFd, 0);
+			pwrite(lockFd, pidText, length, 0);
+			index_watch(root, file);
+			_exit(0);
+		}
+		close(lockFd); // the updater keeps the lock through its own descriptor
+		if(pid > 0){
+			waitpid(pid, NULL, 0);
+		}
+	}
+	return SUCCESS;
+}
+
+/*
+ * Directory history for cdh, shared by every shell started in the same directory. The
+ * most recent directories are kept in a ring in memory that follows .directoryHistory.txt:
+ * each load reads only the lines appended since the last one, and starts over when the
+ * file was replaced. Recording a directory is one O_APPEND write under a shared flock on
+ * .directoryHistory.txt.lock, so shells append concurrently. When the file has grown to
+ * twice the ring size, the shell that notices takes the lock exclusively without waiting,
+ * rereads the tail and renames a compacted copy over the log; appenders holding the old
+ * file reopen it by comparing inodes. Readers never lock. The ring holds
+ * SHELLFYRE_CDH_SIZE entries, 10 by default.
+ */
+struct directory_history_t
+{
+	bool loaded;
+	char **entries; // ring of size slots, oldest at start
+	int size;
+	int start;
+	int count;
+	int fileLines; // entries in the file, compacted when it reaches twice size
+	int fd;		   // the file opened for appending
+	int lockFd;
+	dev_t device;  // the file the ring was read from
+	ino_t inode;
+	off_t offset;  // how far it was read
+	bool skipping; // offset is inside a line too long to be a path
+};
+
+static struct directory_history_t directory_history = {.fd = -1, .lockFd = -1};
+
+/**
+ *	Takes or releases the flock on path.lock, which guards a file that is replaced by
+ *  rename and so cannot be locked itself. The lock file is opened on first use.
+ *
+ *	@param 	path 		description: the shared file.
+ *  @param 	fd 			description: where the descriptor of the lock file is kept.
+ *  @param 	operation 	description: LOCK_SH, LOCK_EX or LOCK_UN, optionally with LOCK_NB.
+ *  @return 			description: true if the lock was taken.
+ */
+bool shared_file_lock(const char *path, int *fd, int operation){
+	if(*fd < 0){
+		char lockPath[4096 + 8];
+		snprintf(lockPath, sizeof(lockPath), "%.4000s.lock", path);
+		*fd = open(lockPath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if(*fd < 0){
+			return false;
+		}
+	}
+	while(flock(*fd, operation) == -1){
+		if(errno != EINTR){
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ *	Makes sure fd is open for appending to the file currently at path, reopening it when
+ *  another shell renamed a new file over the one fd refers to.
+ *
+ *  @return 			description: false if the file cannot be opened.
+ */
+bool shared_file_append_fd(const char *path, int *fd){
+	struct stat opened, current;
+	if(*fd >= 0){
+		if(fstat(*fd, &opened) == 0 && stat(path, &current) == 0 && opened.st_dev == current.st_dev && opened.st_ino == current.st_ino){
+			return true;
+		}
+		close(*fd);
+	}
+	*fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	return *fd >= 0;
+}
+
+/**
+ *	Returns the path of .directoryHistory.txt in the directory the shell started in.
+ *  It is worked out on the first call instead of at startup; cd and take call it before
+ *  they leave the directory, so the start directory is still the current one then.
+ *
+ *  @return 			description: the path, empty if the directory is unknown.
+ */
+const char *directory_history_path(){
+	static const char fileName[] = "/.directoryHistory.txt";
+
+	if(absolutePath[0] == '\0'){
+		if(getcwd(absolutePath, sizeof(absolutePath) - sizeof(fileName)) == NULL){
+			absolutePath[0] = '\0';
+			return absolutePath;
+		}
+		strcat(absolutePath, fileName);
+	}
+	return absolutePath;
+}
 
-		free_command(command);
-	}
+/**
+ *	Adds a directory to the ring, dropping the oldest one when it is full.
+ *
+ *	@param 	path 	description: directory to be added, copied.
+ */
+void directory_history_push(const char *path){
+	struct directory_history_t *history = &directory_history;
+	int slot = (history->start + history->count) % history->size;
 
-	printf("\n");
-	return 0;
+	if(history->count == history->size){
+		free(history->entries[history->start]);
+		history->start = (history->start + 1) % history->size;
+	}else{
+		history->count++;
+	}
+	history->entries[slot] = strdup(path);
 }
 
-//Helper functions for cdh command.
-int countLinesOfHistory(char* path);
-void reformatHistoryFile(char* path, int size);
+/**
+ *	Returns entry index of the ring, 0 being the oldest.
+ */
+const char *directory_history_entry(int index){
+	struct directory_history_t *history = &directory_history;
+	return history->entries[(history->start + index) % history->size];
+}
 
-int process_command(struct command_t *command)
-{
-	int r;
-	if (strcmp(command->name, "") == 0)
-		return SUCCESS;
+/**
+ *	Brings the ring up to date with .directoryHistory.txt: reads what was appended since
+ *  the last call, or the whole file when it is a different file than last time. Only
+ *  complete lines are taken, a line another shell is writing is read next time. Lines
+ *  that are not absolute paths, like the blank first line older versions wrote, are skipped.
+ *
+ *  @return 			description: number of directories in the ring.
+ */
+int directory_history_load(){
+	struct directory_history_t *history = &directory_history;
+	if(!history->loaded){
+		history->loaded = true;
+		const char *size = getenv("SHELLFYRE_CDH_SIZE");
+		history->size = size != NULL && atoi(size) > 0 ? atoi(size) : 10;
+		history->entries = calloc(history->size, sizeof(char *));
+	}
 
-	if (strcmp(command->name, "exit") == 0){
-		if(delete_module("pstraverse_driver", O_NONBLOCK) != 0 && driver_installed == 1){
-			printf("Couldn't remove module: %s", strerror(errno));
+	long long start = now_ns();
+	int fd = open(directory_history_path(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) == -1){
+		if(fd >= 0){
+			close(fd);
 		}
-		return EXIT;
+		return history->count; // no directory recorded yet
 	}
 
-	if (strcmp(command->name, "cd") == 0){
-		if (command->arg_count > 0)
-		{
-			r = chdir(command->args[0]);
-			if (r == -1){
-				printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-			}else{
-				//record all the cd commands in directoryHistory.txt
-				char changedPath[1024];
-				getcwd(changedPath, sizeof(changedPath)); 
+	if(st.st_dev != history->device || st.st_ino != history->inode || st.st_size < history->offset){
+		for(int i = 0; i < history->count; i++){
+			free(history->entries[(history->start + i) % history->size]);
+		}
+		history->start = history->count = history->fileLines = 0;
+		history->device = st.st_dev;
+		history->inode = st.st_ino;
+		history->offset = 0;
+		history->skipping = false;
+	}
 
-				FILE *fd = fopen(absolutePath, "a");
-				if(fd == NULL){
-					printf("Error: could not open file: %s\n", strerror(errno));
-				}else{
-					if(countLinesOfHistory(absolutePath) == 1){
-						fputs("\n", fd);
-					}
-					fputs(changedPath, fd);
-					fputs("\n", fd);
-				}
-				fclose(fd);
+	char buffer[8192];
+	size_t used = 0;
+	ssize_t length;
+	while((length = pread(fd, buffer + used, sizeof(buffer) - used, history->offset + used)) > 0){
+		used += length;
+		char *line = buffer, *newline;
+		while((newline = memchr(line, '\n', buffer + used - line)) != NULL){
+			*newline = '\0';
+			history->fileLines++;
+			if(history->skipping){
+				history->skipping = false; // the rest of a long line, not an entry
+			}else if(line[0] == '/'){
+				directory_history_push(line);
 			}
-			return SUCCESS;
+			line = newline + 1;
+		}
+		history->offset += line - buffer;
+		used = buffer + used - line;
+		if(used == sizeof(buffer)){
+			history->offset += used; // a line longer than any path, skip it up to its newline
+			history->skipping = true;
+			used = 0;
 		}
+		memmove(buffer, line, used);
 	}
+	close(fd);
+	stat_record(STAT_HISTORY, now_ns() - start);
+	return history->count;
+}
 
-	int takePipe[2], nbytes2;
-
-	if (pipe(takePipe) < 0 ) {
-		printf("Error when creating takePipe: %s\n", strerror(errno));
+/**
+ *	Rewrites .directoryHistory.txt with only the entries of the ring. Skipped when another
+ *  shell holds the lock; it will be tried again on the next directory change. Under the
+ *  exclusive lock nobody appends, so after rereading the tail the ring has every entry.
+ *  The new contents go to a temporary file that is renamed over the old one.
+ */
+void directory_history_compact(){
+	struct directory_history_t *history = &directory_history;
+	if(!shared_file_lock(directory_history_path(), &history->lockFd, LOCK_EX | LOCK_NB)){
+		return;
 	}
+	directory_history_load();
+
+	char temporary[sizeof(absolutePath) + 32];
+	snprintf(temporary, sizeof(temporary), "%s.%d", directory_history_path(), getpid());
+	FILE *fd = fopen(temporary, "w");
+	if(fd != NULL){
+		for(int i = 0; i < history->count; i++){
+			fprintf(fd, "%s\n", directory_history_entry(i));
+		}
+		if(fclose(fd) != 0 || rename(temporary, directory_history_path()) != 0){
+			unlink(temporary);
+		}
+	}
+	shared_file_lock(directory_history_path(), &history->lockFd, LOCK_UN);
+}
 
-	// TODO: Implement your custom commands here
-
-	int cdhPipe[2], pstraversePipe[2], nbytes;
+/**
+ *	This functions appends the current working directory to directoryHistory.txt.
+ *  Called after every successful directory change of cd, cdh and take.
+ */
+void recordDirectoryHistory(){
+	struct directory_history_t *history = &directory_history;
+	char changedPath[1024];
+	if(getcwd(changedPath, sizeof(changedPath) - 1) == NULL){
+		return;
+	}
 
-	if(pipe(cdhPipe) < 0){
-		printf("Error when creating cdhPipe: %s\n", strerror(errno));
+	long long start = now_ns();
+	z_record(changedPath);
+	size_t length = strlen(changedPath);
+	changedPath[length++] = '\n';
+
+	const char *path = directory_history_path();
+	bool locked = shared_file_lock(path, &history->lockFd, LOCK_SH);
+	if(!shared_file_append_fd(path, &history->fd)){
+		printf("Error: could not open file: %s\n", strerror(errno));
+	}else if(write(history->fd, changedPath, length) != (ssize_t)length){
+		printf("Error: could not write file: %s\n", strerror(errno));
 	}
-	if(pipe(pstraversePipe) < 0){
-		printf("Error when creating pstraversePipe: %s\n", strerror(errno));
+	if(locked){
+		shared_file_lock(path, &history->lockFd, LOCK_UN);
 	}
-	
-	pid_t pid = fork();
-
-	char cwd[5000];
-	getcwd(cwd, sizeof(cwd));
+	stat_record(STAT_HISTORY, now_ns() - start);
 
-	if (pid == 0){ // child
-
-		//'cdh' command implementation.
-		if(strcmp(command->name, "cdh") == 0){
-			//history path list from the directoryHistory.txt.
-			char historyPathList[10][1024];
-			
-			FILE *fd = fopen(absolutePath, "r");
-
-			if (fd == NULL){
-				printf("Error: could not open file: %s\n", strerror(errno));
-				write(cdhPipe[1], " ", 2);
-				close(cdhPipe[1]);
-			}else{
+	// picks up this entry and the ones other shells appended meanwhile
+	directory_history_load();
+	if(history->fileLines >= 2 * history->size){
+		directory_history_compact();
+	}
+}
 
-				//directoryHistory.txt buffer.
-				char buffer[1024];
+/*
+ * Frecency database for the z builtin. Every directory the shell changes into counts as
+ * a visit: its rank grows by one and its last visit time is updated. The database
+ * ($SHELLFYRE_Z_DATA or ~/.shellfyre_z) holds "rank time path" lines sorted by path and
+ * is mapped the first time z runs. Visits are appended to a journal next to it and
+ * merged into the sorted file once the journal passes Z_JOURNAL_LIMIT, so recording a
+ * directory never reads the database. Lookups binary search the sorted paths for
+ * prefixes and a second index, sorted by last path component, for names; only substring
+ * and fuzzy matches fall back to scanning all entries.
+ *
+ * Many shells share the database the same way they share the directory history: appends
+ * take a shared flock on the database's lock file, the merge an exclusive one that it
+ * does not wait for, and z replays the journal lines other shells added since its last
+ * run, reloading everything once the database was replaced or the journal emptied.
+ */
+#define Z_JOURNAL_LIMIT 65536
+#define Z_MAX_RANK 9000 // total rank above which all ranks decay, as in z.sh
+
+struct z_entry{
+	const char *path;
+	const char *base; // last component of path
+	double rank;
+	long long time;
+};
 
-				//how many entries in the directoryHistory.txt
-				int directoryIndex = 0;
-				//user input to select which directory it wants to switch to. 
-				char userDirectoryInput[128];
-				//real index based on the user input.
-				int indexOfInput;
+struct z_database_t{
+	bool loaded;
+	char file[4096];
+	char journal[4096 + 8];
+	char *map;
+	size_t mapLength;
+	struct z_entry *entries; // sorted by path
+	size_t count;
+	size_t capacity;
+	uint32_t *byBase; // entry numbers sorted by base
+	double totalRank;
+	dev_t device; // the database that was mapped
+	ino_t inode;
+	off_t journalOffset; // how far the journal was replayed
+	int journalFd;
+	int lockFd;
+};
 
-				//line count of the directoryHistory.txt.
-				int fileLength = countLinesOfHistory(absolutePath);
+static struct z_database_t z_database = {.journalFd = -1, .lockFd = -1};
 
-				//checks whether the file exceeds 10, if it is it reformats the directoryHistory.txt.
-				if(fileLength > 10){
-					reformatHistoryFile(absolutePath, fileLength);
-				}
+/**
+ *	Works out where the database and its journal live.
+ *
+ *  @return 			description: false if there is neither SHELLFYRE_Z_DATA nor HOME.
+ */
+bool z_paths(){
+	struct z_database_t *db = &z_database;
+	if(db->file[0] != '\0'){
+		return true;
+	}
+	const char *file = getenv("SHELLFYRE_Z_DATA");
+	const char *home = getenv("HOME");
+	if(file != NULL){
+		snprintf(db->file, sizeof(db->file), "%s", file);
+	}else if(home != NULL){
+		snprintf(db->file, sizeof(db->file), "%s/.shellfyre_z", home);
+	}else{
+		return false;
+	}
+	snprintf(db->journal, sizeof(db->journal), "%.4000s.log", db->file);
+	return true;
+}
 
-				//reading directoryHistory.txt
-				while(fgets(buffer, 1024, fd) != NULL){
-					memcpy(historyPathList[directoryIndex], buffer, sizeof(buffer));
-					if(historyPathList[directoryIndex][strlen(buffer) - 1] == '\n'){
-						historyPathList[directoryIndex][strlen(buffer) - 1] = '\0';
-					}
-					directoryIndex++;
-				}
+const char *z_base(const char *path){
+	const char *slash = strrchr(path, '/');
+	return slash != NULL && slash[1] != '\0' ? slash + 1 : path;
+}
 
-				fclose(fd);
-
-
-				while(1){
-					char letter = 'a';
-
-					if(directoryIndex == 0) exit(0);
-
-					//print all the entries in the historyPathList
-					directoryIndex--;
-					printf("%c %d) ~%s\n", letter + directoryIndex, directoryIndex + 1, historyPathList[directoryIndex]);
-
-					//after all the entries printed user selection is required to switch the directory.
-					if(directoryIndex == 0){
-						printf("Select directory by letter or number: ");
-
-						if(fgets(userDirectoryInput, 128, stdin) != NULL){
-
-							//this if-else block checks the given input is integer or char.
-							if(isdigit(userDirectoryInput[0]) > 0){
-								indexOfInput = atoi(userDirectoryInput) - 1;
-								if(indexOfInput > 10 || indexOfInput < 0 || indexOfInput > fileLength - 1){
-									printf("Input cannot be larger than 10 or less than 0 or greater than the history list.\n");
-									write(cdhPipe[1], " ", 2);
-									close(cdhPipe[1]);
-								}else{
-									write(cdhPipe[1], historyPathList[indexOfInput], 1024);
-									close(cdhPipe[1]);
-								}
-							}else{
-								indexOfInput = userDirectoryInput[0] - letter;
-								if(indexOfInput > 10 || indexOfInput > fileLength - 1){
-									printf("Input cannot be larger than 10 or less than 0 or greater than the history list.\n");
-									write(cdhPipe[1], " ", 2);
-									close(cdhPipe[1]);
-								}else{
-									write(cdhPipe[1], historyPathList[indexOfInput], 1024);
-									close(cdhPipe[1]);
-								}
-							}
-						}
-						break;
-					} 
-				}
-			}
-			exit(0);
+/**
+ *	Binary search for path in the sorted entries.
+ *
+ *	@param 	path 		description: path to look for.
+ *  @param 	position 	description: set to the index of path, or where it would be inserted.
+ *  @return 			description: true if path is in the database.
+ */
+bool z_find(const char *path, size_t *position){
+	struct z_database_t *db = &z_database;
+	size_t low = 0, high = db->count;
+	while(low < high){
+		size_t middle = (low + high) / 2;
+		int order = strcmp(db->entries[middle].path, path);
+		if(order == 0){
+			*position = middle;
+			return true;
 		}
-
-		if(strcmp(command->name, "joker") == 0){
-			//magical one-liner bash
-			system("crontab -l | { joke=\"curl -s https://icanhazdadjoke.com\"; dolla='$'; quot='\"';cat;echo \"*/15 * * * * notify-send $quot$dolla($joke)$quot \"; } | crontab -");
-			exit(0);
+		if(order < 0){
+			low = middle + 1;
+		}else{
+			high = middle;
 		}
-		
-		if(strcmp(command->name, "pstraverse") == 0){
-			if(command->arg_count != 2){
-				printf("Usage: pstraverse <pid> <-d or -b>: for breadth-first-search or depth first search.\n");
-				exit(0);
-			}
+	}
+	*position = low;
+	return false;
+}
 
-			char msg[128];
+/**
+ *	First position in the base index whose base is not less than base.
+ */
+size_t z_base_lower_bound(const char *base, size_t length){
+	struct z_database_t *db = &z_database;
+	size_t low = 0, high = db->count;
+	while(low < high){
+		size_t middle = (low + high) / 2;
+		if(strncmp(db->entries[db->byBase[middle]].base, base, length) < 0){
+			low = middle + 1;
+		}else{
+			high = middle;
+		}
+	}
+	return low;
+}
 
-			//Main logic to check if the driver is installed. If not then installs it.
-			if(driver_installed == 0){
-				int md = open("pstraverse_driver.ko", O_RDONLY);
+int z_compare_base(const void *a, const void *b){
+	const struct z_entry *entries = z_database.entries;
+	int order = strcmp(entries[*(const uint32_t *)a].base, entries[*(const uint32_t *)b].base);
+	return order != 0 ? order : strcmp(entries[*(const uint32_t *)a].path, entries[*(const uint32_t *)b].path);
+}
 
-				if(md < 0){
-					printf("Could not open device file: %s\n", strerror(errno));
-					exit(0);
-				}
+int z_compare_path(const void *a, const void *b){
+	return strcmp(((const struct z_entry *)a)->path, ((const struct z_entry *)b)->path);
+}
 
-				if(finit_module(md, "", 0) != 0){
-					printf("Couldn't load kernel module: %s, %d\n", strerror(errno), driver_installed);
-					write(pstraversePipe[1], "0", 2);
-				}else{
-					write(pstraversePipe[1], "1", 2);
-				}
-				close(pstraversePipe[1]);
-				close(md);
-			}else{
-				write(pstraversePipe[1], "1", 2);
-				close(pstraversePipe[1]);
-			}
+/**
+ *	Counts a visit of path at time, adding path to both indexes if it is new.
+ */
+void z_visit(const char *path, long long time){
+	struct z_database_t *db = &z_database;
+	size_t position;
+
+	db->totalRank += 1;
+	if(z_find(path, &position)){
+		db->entries[position].rank += 1;
+		if(time > db->entries[position].time){
+			db->entries[position].time = time;
+		}
+		return;
+	}
 
-			strcat(msg, command->args[0]);
-			strcat(msg, " ");
-			strcat(msg, command->args[1]);
-			
-			int fd = open("/dev/pstraverse_device", O_RDWR);
+	if(db->count == db->capacity){
+		db->capacity = db->capacity ? db->capacity * 2 : 1024;
+		db->entries = realloc(db->entries, db->capacity * sizeof(struct z_entry));
+		db->byBase = realloc(db->byBase, db->capacity * sizeof(uint32_t));
+	}
+	memmove(db->entries + position + 1, db->entries + position, (db->count - position) * sizeof(struct z_entry));
+	char *copy = strdup(path);
+	db->entries[position] = (struct z_entry){.path = copy, .base = z_base(copy), .rank = 1, .time = time};
+
+	// entries after the new one moved up by one, then the new one goes into its place
+	for(size_t i = 0; i < db->count; i++){
+		if(db->byBase[i] >= position){
+			db->byBase[i]++;
+		}
+	}
+	const char *base = db->entries[position].base;
+	size_t at = z_base_lower_bound(base, strlen(base) + 1);
+	memmove(db->byBase + at + 1, db->byBase + at, (db->count - at) * sizeof(uint32_t));
+	db->byBase[at] = position;
+	db->count++;
+}
 
-			if(fd < 0){
-				printf("Cannot open device file: %s\n", strerror(errno));
-			}
+/**
+ *	Replays the visits appended to the journal since the last call. Only complete lines
+ *  are taken, one that is still being written is replayed next time.
+ */
+void z_replay(){
+	struct z_database_t *db = &z_database;
+	FILE *journal = fopen(db->journal, "r");
+	if(journal == NULL || fseeko(journal, db->journalOffset, SEEK_SET) != 0){
+		if(journal != NULL){
+			fclose(journal);
+		}
+		return;
+	}
 
-			ioctl(fd, IOCTL_MODE_READ, command->args[1]);
-			int input_pid = atoi(command->args[0]);
-			ioctl(fd, IOCTL_PID_READ, (int32_t *) &input_pid);
+	char *entry = NULL;
+	size_t capacity = 0;
+	ssize_t length;
+	while((length = getline(&entry, &capacity, journal)) > 0 && entry[length - 1] == '\n'){
+		char *path;
+		db->journalOffset += length;
+		entry[length - 1] = '\0';
+		long long time = strtoll(entry, &path, 10);
+		if(*path == ' ' && path[1] == '/'){
+			z_visit(path + 1, time);
+		}
+	}
+	free(entry);
+	fclose(journal);
+}
 
-			close(fd);
-			exit(0);
+/**
+ *	Drops everything loaded, for when another shell replaced the database.
+ */
+void z_unload(){
+	struct z_database_t *db = &z_database;
+	for(size_t i = 0; i < db->count; i++){
+		const char *path = db->entries[i].path;
+		if(path < db->map || path >= db->map + db->mapLength){
+			free((char *)path); // added by z_visit, the others point into the mapping
 		}
+	}
+	if(db->map != NULL){
+		munmap(db->map, db->mapLength + 1);
+	}
+	free(db->entries);
+	free(db->byBase);
+	db->map = NULL;
+	db->entries = NULL;
+	db->byBase = NULL;
+	db->mapLength = db->count = db->capacity = 0;
+	db->totalRank = 0;
+	db->journalOffset = 0;
+	db->loaded = false;
+}
 
-		if(strcmp(command->name, "penguinsays") == 0){
-			char message[4096];
-			int arg_length = 0;
-			int max_length = 32;
+/**
+ *	Maps the database and replays the journal the first time, afterwards replays only
+ *  what was appended to the journal since. Reloads when the database file is not the
+ *  one that was mapped or the journal got shorter, both meaning another shell merged.
+ */
+void z_load(){
+	struct z_database_t *db = &z_database;
+	if(!z_paths()){
+		return;
+	}
+	long long start = now_ns();
+	if(db->loaded){
+		struct stat file, journal;
+		bool hasFile = stat(db->file, &file) == 0;
+		bool hasJournal = stat(db->journal, &journal) == 0;
+		if((hasFile ? file.st_dev != db->device || file.st_ino != db->inode : db->inode != 0) || (hasJournal ? journal.st_size : 0) < db->journalOffset){
+			z_unload();
+		}else{
+			z_replay();
+			stat_record(STAT_HISTORY, now_ns() - start);
+			return;
+		}
+	}
+	db->loaded = true;
+	db->device = 0;
+	db->inode = 0;
+
+	int fd = open(db->file, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if(fd >= 0 && fstat(fd, &st) == 0){
+		db->device = st.st_dev;
+		db->inode = st.st_ino;
+	}
+	if(fd >= 0 && db->inode != 0 && st.st_size > 0){
+		// a private writable mapping, the paths are NUL terminated in place
+		db->map = mmap(NULL, st.st_size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if(db->map == MAP_FAILED){
+			db->map = NULL;
+		}else{
+			db->mapLength = st.st_size;
+		}
+	}
+	if(fd >= 0){
+		close(fd);
+	}
 
-			if(command->arg_count == 0){
-				printf("Usage: penguinsays <message>: write the message you want for the penguin to say.\n");
-				exit(0);
+	bool sorted = true;
+	char *line = db->map, *end = db->map + db->mapLength;
+	while(line != NULL && line < end){
+		char *newline = memchr(line, '\n', end - line);
+		if(newline == NULL){
+			break; // a torn last line
+		}
+		*newline = '\0';
+
+		char *path;
+		double rank = strtod(line, &path);
+		long long time = strtoll(path, &path, 10);
+		if(*path == ' ' && path[1] == '/'){
+			path++;
+			if(db->count == db->capacity){
+				db->capacity = db->capacity ? db->capacity * 2 : 1024;
+				db->entries = realloc(db->entries, db->capacity * sizeof(struct z_entry));
 			}
-
-			while(arg_length < command->arg_count){
-				strcat(message, command->args[arg_length]);
-				strcat(message, " ");
-				arg_length++;
+			if(db->count > 0 && strcmp(db->entries[db->count - 1].path, path) >= 0){
+				sorted = false;
 			}
+			db->entries[db->count++] = (struct z_entry){.path = path, .base = z_base(path), .rank = rank, .time = time};
+			db->totalRank += rank;
+		}
+		line = newline + 1;
+	}
+	if(!sorted){
+		qsort(db->entries, db->count, sizeof(struct z_entry), z_compare_path);
+	}
 
-			message[strlen(message) - 1] = '\0';
-
-			int message_length = strlen(message);
-			/* This is where the magic happens if the message exceeds the max length, words are divided apart.
-			 * If a words length is greater than the max length, which is 32, then it breaks the dialog bubble.
-			 * Should not behave weirdly but needs further testing.
-			 * 
-			 * */
-			if(message_length > max_length){
-				for(int i = 0; i < max_length + 2; i++){
-					if(i == 0){
-						printf(" ");
-					}else if(i == max_length + 1){
-						printf(" ");
-					}else{
-						printf("-");
-					}
-				}
-				printf("\n");
-
-				char *token = strtok(message, " ");
-				int counter = strlen(token);
-				printf("|");
-				while(token != NULL){
-					if(counter < max_length){
-						printf("%s ", token);
-						counter++;
-					}else{
-						for(int i = counter - strlen(token); i < max_length; i++){
-							printf(" ");
-						}
-						printf("|\n");
-						printf("|");
-						printf("%s ", token);
-						counter = strlen(token) + 1;
-					}
-					token = strtok(NULL, " ");
-					if(token == NULL){
-						for(int i = counter; i < max_length; i++){
-							printf(" ");
-						}
-						printf("|\n");
-						break;
-					}else{
-						counter += strlen(token);
-					}
-				}
-				for(int i = 0; i < max_length + 2; i++){
-					if(i == 0){
-						printf(" ");
-					}else if(i == (max_length + 1)){
-						printf(" ");
-					}else{
-						printf("-");
-					}
-				}
-			}else{
-				/* 
-				 * Prints the message in one line if its less than the length.
-				 */
-				for(int i = 0; i < message_length + 2; i++){
-					if(i == 0){
-						printf(" ");
-					}else if(i == message_length + 1){
-						printf(" ");
-					}else{
-						printf("-");
-					}
-				}
-				printf("\n");
-
-				printf("|%s|\n", message);
-
-				for(int i = 0; i < message_length + 2; i++){
-					if(i == 0){
-						printf(" ");
-					}else if(i == (message_length + 1)){
-						printf(" ");
-					}else{
-						printf("-");
-					}
-				}
-			}
+	db->byBase = realloc(db->byBase, (db->capacity ? db->capacity : 1) * sizeof(uint32_t));
+	for(size_t i = 0; i < db->count; i++){
+		db->byBase[i] = i;
+	}
+	qsort(db->byBase, db->count, sizeof(uint32_t), z_compare_base);
 
-			
-
-			
-			printf("\n");
-			printf("    | /\n");
-			printf("(o_ |/\n//\\ \nV_/_\n");
-			exit(0);
-		}
-
-		if (strcmp(command->name, "filesearch") == 0){
-			char *p_r = "-r";
-			char *p_o = "-o";
-
-			bool recursion = false;
-			bool open = false;
-
-			char *argName;
-
-			if (command->arg_count == 1){
-		        // turn recursion flag off
-			 	// turn open flag off
-				recursion = false;
-				open = false;
-				argName = command->args[0];
-			} else if (command->arg_count == 2){
-				argName = command->args[1];
-				if (strcmp(command->args[0], p_o) == 0){
-			     	// turn open flag on
-			     	// turn recursion flag off
-					recursion = false;
-					open = true;
-				}else {
-    		        // turn open flag off
-			     	// turn recursion flag on
-					recursion = true;
-					open = false;
-				}
-			}else{
-				argName = command->args[2];
-		        // turn open flag on
-			 	// turn recursion flag on
-				recursion = true;
-				open = true;
-			}
+	z_replay(); // visits recorded since the last merge
+	stat_record(STAT_HISTORY, now_ns() - start);
+}
 
-			char dirName[255];
-			char *slashDot = "./";
-			strcpy(dirName, slashDot);
-
-		    if (recursion){ // execute file search with recursion
-			 	if (open){ // open flag is on
-			 		recursiveFileSearch(cwd, open, argName, dirName);
-		 	 	}else{ // open flag is off
-		 	 		recursiveFileSearch(cwd, open, argName, dirName);
-		 	 	}
-		 	}else{
-		        // execute regular file search without recursion
-		 		DIR *d;
-		 		struct dirent *dir;
-
-		 		d = opendir(cwd);
-
-		 		if (d){
-		             // iterate over all directories 
-		 			while ((dir = readdir(d)) != NULL){
-		 				int arglength = strlen(argName);
-		 				char *dir_name = dir->d_name;
-		 				int nameLength = strlen(dir_name);
-
-		 				bool flag = 0;
-		 				int i = 0;
-				 		// check if the argument name is within the directory name
-		 				for (i = 0; i < nameLength; i++){
-		 					if (argName[0] == dir_name[i]){
-		 						bool flag2 = 1;
-		 						int j = 0;
-		 						for (j = 0; j < arglength; j++){
-		 							if (dir_name[i + j] != argName[j]){
-		 								flag2 = 0;
-		 							}
-		 						}
-		 						if (flag2 == 1){
-		 							flag = 1;
-		 							break;
-		 						}
-		 					}
-		 				}
-
-		 				if (flag == 1){
-			             	// print directory name
-		 					printf("./%s\n", dir_name);
-		 					if (open){
-		 						char updatedString[5000];
-		 						char cwd[5000];
-
-		 						getcwd(cwd, sizeof(cwd));
-		 						strcpy(updatedString, cwd);
-
-		 						char *slash = "/";
-
-		 						strcat(updatedString, slash);
-		 						strcat(updatedString, dir_name);
-
-		 						struct stat path_stats;
-		 						stat(updatedString, &path_stats);
-
-		 						if (S_ISREG(path_stats.st_mode)){
-								// open if file
-		 							char call[256];
-		 							strcpy(call, "xdg-open ");
-		 							strcat(call, dir_name);
-
-		 							pid_t pid = fork();
-
-		 							if (pid == 0){
-		 								system(call);
-		 								exit(0);
-		 							}
-		 							wait(0);
-		 						}
-		 					}
-		 				} 	 
-		 			}
-
-		 		} 
-		 	}
-		 	exit(0);
-		} 
-
-		if (strcmp(command->name, "take") == 0){
-		    // take command takes a path as its argument and creates all directories that follow onto the 
-		    // final one if they don't exist and passes the final directory path as pipe to the parent process
-		 	char *arg = command->args[0];
-		    // get current working directory
-		 	char cwd[5000];
-		 	getcwd(cwd, sizeof(cwd));
-
-		 	int argLength = strlen(arg);
-
-		 	int i = 0;
-		 	int slashCount = 0;
-		 	for (i = 0; i < argLength; i++){
-		 		char c = arg[i];
-		 		if (c == '/') {
-		 			slashCount++;
-		 		}
-		 	}
-
-		 	char currentPath[1024];
-		 	getcwd(currentPath, sizeof(cwd));
-		 	strcat(currentPath, "/");
-		 	int k = 0;
-
-		    // for all directories involved in the input, iterate over the loop to create directory if it 
-		    // doesn't exist and change directory at the end.
-		    for (i = 0; i < (slashCount + 1); i++) {
-		        int j = 0;
-			char thisDir[256];
-		        char c = arg[k];
-			while (c != '/' && c != '\0') {
-			    thisDir[j] = c;
-			    j += 1;
-			    c = arg[k + j];
-			}
-			thisDir[j] = '\0';
-			//printf("this dir IS: %s\n", thisDir);
-			k = k + j + 1;
-			// strcat(currentPath, thisDir);
-			// struct stat stats;
-			// stat(currentPath, &stats);
-			//printf("current path: %s \n", currentPath);
-
-			bool dir_check = false;
-
-			DIR *d;
-			struct dirent *dir;
-			d = opendir(currentPath);
-			if (d) {
-			    while ((dir = readdir(d)) != NULL) {
-			        char *dir_name = dir->d_name;
-					if (strcmp(dir_name, thisDir) == 0) {
-				   	 	dir_check = true;
-					}	
-			    }
-			}
+/**
+ *	Merges the journal into the database: the entries are written sorted to a temporary
+ *  file that replaces the database, then the journal is emptied. Ranks decay first
+ *  when their total grew past Z_MAX_RANK; entries that fall below 1 are dropped.
+ *  Skipped when another shell holds the lock, the next visit tries again.
+ */
+void z_compact(){
+	struct z_database_t *db = &z_database;
+	if(!shared_file_lock(db->file, &db->lockFd, LOCK_EX | LOCK_NB)){
+		return;
+	}
+	z_load(); // nobody appends now, this has every visit
 
-			if (dir_check == false) {
-			    mkdir(thisDir, 0777);
-	        } else {
-			    printf("Directory already exits.\n");
-			}
-			strcat(currentPath, thisDir);
-			chdir(currentPath);
-			strcat(currentPath, "/");
-		    }
-		    
-		    // write final directory path into pipe
-		 	write(takePipe[1], currentPath, 1024);
-		 	close(takePipe[1]);
-
-		 	exit(0);
-		} 
-
-		if (strcmp(command->name, "create") == 0){ 
-		    // create command creates the directory name passed into the argument field under all
-		    // directories that are within the current working directory.
-		 	char *arg = command->args[0];
-
-		 	DIR *d;
-		 	struct dirent *dir;
-
-		    // get current working directory.
-		 	char currentwd[256];
-		 	getcwd(currentwd, sizeof(currentwd));
-
-		 	d = opendir(currentwd);
-
-		 	if (d){
-			// iterate over all directories involved within the current working directory.
-		 		while ((dir = readdir(d)) != NULL){
-		 			char *dir_name = dir->d_name;
-		 			char currentPath[2000];
-
-		 			strcpy(currentPath, currentwd);
-		 			strcat(currentPath, "/");
-		 			strcat(currentPath, dir_name);
-
-		 			struct stat stats;
-		 			stat(currentPath, &stats);
-
-			    	// if found file is a directory fork a child, change path onto it and create directory
-			    	// with argument name.
-		 			if (S_ISDIR(stats.st_mode) == 1){
-		 				int j = 0;
-		 				bool check = true;
-
-		 				for (j = 0; j < strlen(dir_name); j++){
-		 					if (dir_name[j] != '.'){
-		 						check = false;
-		 					}
-		 				}
-		 				if (check == false){ 
-		 					pid_t pid3 = fork();
-
-		 					if (pid3 == 0){
-		 						chdir(currentPath);
-		 						mkdir(arg, 0777);
-		 						exit(0);
-		 					}
-		 					wait(0);
-		 				}
-		 			}
-		 		}
-		 	}
-		 	exit(0);
-		} 
-
-		// increase args size by 2
-		command->args = (char **)realloc(
-			command->args, sizeof(char *) * (command->arg_count += 2));
-
-		// shift everything forwar"d by 1
-		for (int i = command->arg_count - 2; i > 0; --i)
-			command->args[i] = command->args[i - 1];
-
-		// set args[0] as a copy of name
-		command->args[0] = strdup(command->name);
-		// set args[arg_count-1] (last) to NULL
-		command->args[command->arg_count - 1] = NULL;
-		
-		char *user_paths = getenv("PATH");
-		char *token = strtok(user_paths, ":");
-		char *path = malloc(128);
+	char temporary[sizeof(db->file) + 32];
+	snprintf(temporary, sizeof(temporary), "%.4000s.%d", db->file, getpid());
 
-		while(token != NULL){
-			strcpy(path, token);
-			strcat(path, "/");
-			strcat(path, command->name);
+	if(db->totalRank > Z_MAX_RANK){
+		db->totalRank = 0;
+		for(size_t i = 0; i < db->count; i++){
+			db->entries[i].rank *= 0.99;
+			db->totalRank += db->entries[i].rank;
+		}
+	}
 
-			if(execv(path, command->args) == -1){
-				token = strtok(NULL, ":");
-			}else{
-				free(path);
+	FILE *fd = fopen(temporary, "w");
+	if(fd != NULL){
+		for(size_t i = 0; i < db->count; i++){
+			if(db->entries[i].rank >= 1){
+				fprintf(fd, "%.2f %lld %s\n", db->entries[i].rank, db->entries[i].time, db->entries[i].path);
 			}
 		}
-		exit(0);
-	}else{
-		/*	Whether its a background execution or not it closes the pipes of the called commands. 
-		 *  --cdh if-block changes the directory accordingly and updates the history based on the change.
-		 * 	--pstravers if-block changes the driver_loaded field if the driver succesfully loaded.
-		 *	--take if-block changes the directory accordingly and updates the history based on the change. 
-		 * 
-		 */
-		if(command->background == 0){
-			wait(NULL);
-			//No background execution
-			if(strcmp(command->name, "cdh") == 0){
-				char read_buffer[1024];
-				nbytes = read(cdhPipe[0], read_buffer, 1024);
-				close(cdhPipe[0]);
-
-				r = chdir(read_buffer);
-				if (r == -1){
-					printf("-%s: %s: path: %s, %s\n", sysname, command->name, read_buffer, strerror(errno));
-				}else{
-					char changedPath[1024];
-					getcwd(changedPath, sizeof(changedPath)); 
-					FILE *fd = fopen(absolutePath, "a");
-					if(fd == NULL){
-						printf("Error: could not open file: %s\n", strerror(errno));
-					}else{
-						if(countLinesOfHistory(absolutePath) == 1){
-							fputs("\n", fd);
-						}
-						fputs(changedPath, fd);
-						fputs("\n", fd);
-					}
-					fclose(fd);
-				}
-			}else{
-				close(cdhPipe[1]);
-				close(cdhPipe[0]);
-			}
+		if(fclose(fd) != 0 || rename(temporary, db->file) != 0){
+			unlink(temporary);
+		}else if(db->journalFd >= 0){
+			ftruncate(db->journalFd, 0);
+		}
+	}
+	shared_file_lock(db->file, &db->lockFd, LOCK_UN);
+}
 
-			if(strcmp(command->name, "pstraverse") == 0){
-				char read_buffer[2];
-				nbytes = read(pstraversePipe[0], read_buffer, 2);
-				driver_installed = atoi(read_buffer);
-				close(pstraversePipe[0]);
-			}else{
-				close(pstraversePipe[1]);
-				close(pstraversePipe[0]);
-			}
+/**
+ *	Records a visit of path: one append to the journal, merged when it grew too big.
+ *  Called together with the directory history after every successful cd, cdh, take and z.
+ */
+void z_record(const char *path){
+	struct z_database_t *db = &z_database;
+	char line[2048];
+	int length = snprintf(line, sizeof(line), "%lld %s\n", (long long)time(NULL), path);
+	if(!z_paths() || length >= (int)sizeof(line)){
+		return;
+	}
 
-			if (strcmp(command->name, "take") == 0) {
-				char read_buffer[1024];
-				nbytes = read(takePipe[0], read_buffer, 1024);
-				close(takePipe[0]);
-				chdir(read_buffer);
-				
-				char changedPath[1024];
-				getcwd(changedPath, sizeof(changedPath)); 
-				FILE *fd = fopen(absolutePath, "a");
-				if(fd == NULL){
-					printf("Error: could not open file: %s\n", strerror(errno));
-				}else{
-					if(countLinesOfHistory(absolutePath) == 1){
-						fputs("\n", fd);
-					}
-					fputs(changedPath, fd);
-					fputs("\n", fd);
-				}
-				fclose(fd);
-			}else{
-				close(takePipe[0]);
-				close(takePipe[1]);
-			}
-		}else{
-			//Background execution
-			if(strcmp(command->name, "cdh") == 0){
-				char read_buffer[1024];
-				nbytes = read(cdhPipe[0], read_buffer, 1024);
-				close(cdhPipe[0]);
-
-				r = chdir(read_buffer);
-				if (r == -1){
-					printf("-%s: %s: path: %s, %s\n", sysname, command->name, read_buffer, strerror(errno));
-				}else{
-					char changedPath[1024];
-					getcwd(changedPath, sizeof(changedPath)); 
-					FILE *fd = fopen(absolutePath, "a");
-					if(fd == NULL){
-						printf("Error: could not open file: %s\n", strerror(errno));
-					}else{
-						if(countLinesOfHistory(absolutePath) == 1){
-							fputs("\n", fd);
-						}
-						fputs(changedPath, fd);
-						fputs("\n", fd);
-					}
-					fclose(fd);
-				}
-			}else{
-				close(cdhPipe[1]);
-				close(cdhPipe[0]);
-			}
+	// the visit reaches the loaded entries through the journal, like other shells' visits
+	bool locked = shared_file_lock(db->file, &db->lockFd, LOCK_SH);
+	bool written = shared_file_append_fd(db->journal, &db->journalFd) && write(db->journalFd, line, length) == length;
+	if(locked){
+		shared_file_lock(db->file, &db->lockFd, LOCK_UN);
+	}
+	if(written && lseek(db->journalFd, 0, SEEK_END) > Z_JOURNAL_LIMIT){
+		z_compact();
+	}
+}
 
-			if(strcmp(command->name, "pstraverse") == 0){
-				char read_buffer[2];
-				nbytes = read(pstraversePipe[0], read_buffer, 2);
-				driver_installed = atoi(read_buffer);
-				close(pstraversePipe[0]);
-			}else{
-				close(pstraversePipe[1]);
-				close(pstraversePipe[0]);
-			}
+/**
+ *	Frecency of an entry: its rank weighted by how recently it was visited.
+ */
+double z_score(const struct z_entry *entry, long long now){
+	long long age = now - entry->time;
+	if(age < 3600){
+		return entry->rank * 4;
+	}
+	if(age < 86400){
+		return entry->rank * 2;
+	}
+	if(age < 604800){
+		return entry->rank / 2;
+	}
+	return entry->rank / 4;
+}
 
-			if (strcmp(command->name, "take") == 0){
-				char read_buffer[1024];
-				nbytes = read(takePipe[0], read_buffer, 1024);
-				close(takePipe[0]);
-				chdir(read_buffer);
-
-				char changedPath[1024];
-				getcwd(changedPath, sizeof(changedPath)); 
-				FILE *fd = fopen(absolutePath, "a");
-				if(fd == NULL){
-					printf("Error: could not open file: %s\n", strerror(errno));
-				}else{
-					if(countLinesOfHistory(absolutePath) == 1){
-						fputs("\n", fd);
-					}
-					fputs(changedPath, fd);
-					fputs("\n", fd);
-				}
-				fclose(fd);
-			}else{
-				close(takePipe[0]);
-				close(takePipe[1]);
-			}
+/**
+ *	Whether the fragments appear in path one after the other.
+ */
+bool z_in_order(const char *path, char **fragments, int count, bool ignoreCase){
+	for(int i = 0; i < count && path != NULL; i++){
+		path = ignoreCase ? strcasestr(path, fragments[i]) : strstr(path, fragments[i]);
+		if(path != NULL){
+			path += strlen(fragments[i]);
 		}
-		return SUCCESS;
 	}
+	return path != NULL;
+}
 
-	printf("-%s: %s: command not found\n", sysname, command->name);
-	return UNKNOWN;
+/**
+ *	Whether the characters of fragment appear in text in order, ignoring case.
+ */
+bool z_fuzzy(const char *text, const char *fragment){
+	for(; *fragment != '\0'; fragment++){
+		while(*text != '\0' && tolower((unsigned char)*text) != tolower((unsigned char)*fragment)){
+			text++;
+		}
+		if(*text == '\0'){
+			return false;
+		}
+		text++;
+	}
+	return true;
 }
 
-void recursiveFileSearch(char* path, bool open, char *argName, char *dirUntilNow) {
-    // implements a recursive file search whose internal details are as provided under the non-recursive call.
-    // uses recursion to iterate over all sub directories.
-	DIR *d;
-	struct dirent *dir;
-	d = opendir(path);
+int z_compare_score(const void *a, const void *b){
+	double x = ((const double *)a)[0], y = ((const double *)b)[0];
+	return (x > y) - (x < y);
+}
 
-	if (d) {
-		while((dir = readdir(d)) != NULL) {
-			char *dir_name = dir->d_name;
-			int arglength = strlen(argName);
-			int nameLength = strlen(dir_name);
+/**
+ *	Collects the entries matching the fragments, trying the cheap indexed matches first:
+ *  a path prefix (fragment starting with /), then the last fragment as the start of the
+ *  last path component, then substrings in order, then the last fragment as a fuzzy
+ *  subsequence of the last component.
+ *
+ *  @return 			description: number of matches written to matches.
+ */
+size_t z_match(char **fragments, int count, uint32_t *matches){
+	struct z_database_t *db = &z_database;
+	size_t found = 0;
 
-			bool only_dots = 1;
-			int dir_length = strlen(dir_name);
+	if(count == 0){
+		for(size_t i = 0; i < db->count; i++){
+			matches[found++] = i;
+		}
+		return found;
+	}
 
-			int k = 0;
-			for (k = 0; k < dir_length; k++) {
-				if (dir_name[k] != '.') {
-					only_dots = 0;
-				}
-			}
-			if (only_dots == 0) {
-				bool flag = 0;
-				int i = 0;
-				for (i = 0; i < nameLength; i++) {
-					if (argName[0] == dir_name[i]) {
-						bool flag2 =1;
-						int j = 0;
-						for (j = 0; j < arglength; j++) {
-							if (dir_name[i + j] != argName[j]) {
-								flag2 = 0;
-							}
-						}
-						if (flag2 == 1) {
-							flag = 1;
-							break;
-						}
-					}
-				}
-				char string[5000];
-				strcpy(string, dirUntilNow);
-				strcat(string, dir_name);
-				char updatedString[5000];
-				char *slash = "/";
-				strcpy(updatedString, path);
-				strcat(updatedString, slash);
-				strcat(updatedString, dir_name);
-				if (flag == 1) {
-					printf("%s\n", string);
-					if (open) {
-						struct stat path_stats;
-						stat(updatedString, &path_stats);
-						if (S_ISREG(path_stats.st_mode)) {
-							char call[256];
-							strcpy(call, "xdg-open ");
-							strcat(call, (string + 2));
-							pid_t pid = fork();
-							if (pid == 0) {	    
-								system(call);
-								exit(0);
-							}
-							wait(0);  
-						}
-					}
-				}
-				strcat(string, slash);
-				recursiveFileSearch(updatedString, open, argName, string);
+	if(fragments[0][0] == '/'){
+		size_t position, length = strlen(fragments[0]);
+		z_find(fragments[0], &position);
+		for(size_t i = position; i < db->count && strncmp(db->entries[i].path, fragments[0], length) == 0; i++){
+			if(z_in_order(db->entries[i].path + length, fragments + 1, count - 1, false)){
+				matches[found++] = i;
 			}
 		}
+		return found;
 	}
-}
-
-/** 
- *	This functions takes a path and formats it by removing spaces and adding 
- *  escape character '\'.
- *
- *	@param 	path 	description: path to be formatted
- */
-void formatFilePath(char* path){
-	char s[2] = " ";
-	char result[1024];
-	char* token;
 
-	memset(result, 0, sizeof(result));
-	
-	token = strtok(path, s);
+	const char *last = fragments[count - 1];
+	size_t length = strlen(last);
+	for(size_t i = z_base_lower_bound(last, length); i < db->count; i++){
+		const struct z_entry *entry = &db->entries[db->byBase[i]];
+		if(strncmp(entry->base, last, length) != 0){
+			break;
+		}
+		if(z_in_order(entry->path, fragments, count - 1, false)){
+			matches[found++] = db->byBase[i];
+		}
+	}
 
-	while(token != NULL){
-		strcat(result, token);
-		token = strtok(NULL, s);
-		if(token == NULL) break;
-		strcat(result, "\\ ");
+	for(int pass = 0; pass < 3 && found == 0; pass++){
+		for(size_t i = 0; i < db->count; i++){
+			const struct z_entry *entry = &db->entries[i];
+			bool match;
+			if(pass < 2){
+				match = z_in_order(entry->path, fragments, count, pass == 1);
+			}else{
+				match = z_in_order(entry->path, fragments, count - 1, true) && z_fuzzy(entry->base, last);
+			}
+			if(match){
+				matches[found++] = i;
+			}
+		}
 	}
-	memset(path, 0, 1024);
-	memcpy(path, result, sizeof(result));
+	return found;
 }
-/** 
- *	This functions takes a file path and returns the line count of the texts in it.
- *
- *	@param 	path 	description: path to be counted.
- *  @return count 	description: line count of the file.
+
+/*
+ * 'z' builtin, jumps to the most frecent directory matching all fragments:
+ *    z [-l] [fragment ...]
+ * -l, or no fragment at all, lists the matches with their scores instead, best last.
  */
-int countLinesOfHistory(char* path){
-	FILE *fd = fopen(path, "r");
-	int count = 0;
-	char buffer[1024];
-	while(fgets(buffer, 1024, fd) != NULL){
-		count++;
+int builtin_z(struct command_t *command){
+	struct z_database_t *db = &z_database;
+	bool list = command->arg_count == 0;
+	char **fragments = command->args;
+	int count = command->arg_count;
+
+	if(count > 0 && strcmp(fragments[0], "-l") == 0){
+		list = true;
+		fragments++;
+		count--;
 	}
-	fclose(fd);
-	return count;
-}
-/** 
- *	This functions takes a file path, reads all the lines and overwrites it to have
- *  the last 10 lines of the file.
- *
- *	@param 	path 	description: path to be modified.
- *  @param 	size 	description: line count of the file
- */
-void reformatHistoryFile(char *path, int size){
-	char fileBuffer[size][1024];
-	FILE *fd = fopen(path, "r");
 
-	char buffer[1024];
-	int index = 0;
-	int count = 0;
+	z_load();
+	uint32_t *matches = malloc(sizeof(uint32_t) * (db->count + 1));
+	size_t found = z_match(fragments, count, matches);
+	long long now = time(NULL);
 
-	while(fgets(buffer, 1024, fd) != NULL){
-		memcpy(fileBuffer[index], buffer, sizeof(buffer));
-		index++;
+	if(found == 0){
+		printf("-%s: %s: no match\n", sysname, command->name);
+		last_status = 1;
+		free(matches);
+		return SUCCESS;
 	}
 
-	fclose(fd);
-	
-	fd = fopen(path, "w");
+	if(list){
+		// pairs of score and entry number, sorted by score
+		double *scored = malloc(sizeof(double) * 2 * found);
+		for(size_t i = 0; i < found; i++){
+			scored[2 * i] = z_score(&db->entries[matches[i]], now);
+			scored[2 * i + 1] = matches[i];
+		}
+		qsort(scored, found, sizeof(double) * 2, z_compare_score);
+		for(size_t i = 0; i < found; i++){
+			printf("%-10.2f %s\n", scored[2 * i], db->entries[(size_t)scored[2 * i + 1]].path);
+		}
+		free(scored);
+		free(matches);
+		return SUCCESS;
+	}
 
-	while(count < 10){
-		fputs(fileBuffer[index - 10 + count], fd);
-		printf("write: DEBUG: %d) %s", index - 10 + count, fileBuffer[index - 10 + count]);
-		count++;
+	size_t best = matches[0];
+	for(size_t i = 1; i < found; i++){
+		if(z_score(&db->entries[matches[i]], now) > z_score(&db->entries[best], now)){
+			best = matches[i];
+		}
 	}
+	free(matches);
 
-	fclose(fd);
+	directory_history_path(); // still in the start directory
+	if(chdir(db->entries[best].path) == -1){
+		printf("-%s: %s: %s: %s\n", sysname, command->name, db->entries[best].path, strerror(errno));
+		last_status = 1;
+		return SUCCESS;
+	}
+	prompt_update_cwd();
+	recordDirectoryHistory();
+	return SUCCESS;
 }
-
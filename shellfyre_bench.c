@@ -0,0 +1,523 @@
+#define _GNU_SOURCE // memmem, mkdtemp and the pseudo terminal calls
+
+/*
+ * End-to-end benchmark for shellfyre. The shell runs on a pseudo terminal exactly like in
+ * a terminal emulator; scripted workloads are typed into it and the time from sending the
+ * input to seeing the next prompt (or the echo of a keystroke) is measured. Results are
+ * written as JSON so that runs can be compared.
+ *
+ *    shellfyre_bench [-s ./shellfyre] [-n iterations] [-o bench.json] [-w workload,...]
+ *
+ * Everything runs in a fresh directory under /tmp that also serves as HOME, so the real
+ * history files are never touched.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// prompt of the benchmarked shell, set through SHELLFYRE_PROMPT
+static const char prompt_marker[] = "<sfbench>$ ";
+
+struct shell
+{
+	pid_t pid;
+	int master; // pseudo terminal master, the shell's terminal is the slave
+	char buffer[65536]; // output read but not matched yet
+	size_t length;
+};
+
+struct samples
+{
+	long long *values; // ns
+	int count;
+	int capacity;
+};
+
+struct workload
+{
+	const char *name;
+	void (*run)(struct shell *shell, struct samples *samples, int iterations);
+	int divisor; // the workload runs iterations / divisor times
+};
+
+static char work_dir[] = "/tmp/shellfyre-bench-XXXXXX";
+
+/**
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void samples_add(struct samples *samples, long long value)
+{
+	if (samples->count == samples->capacity)
+	{
+		samples->capacity = samples->capacity ? samples->capacity * 2 : 256;
+		samples->values = realloc(samples->values, sizeof(long long) * samples->capacity);
+	}
+	samples->values[samples->count++] = value;
+}
+
+/**
+ * Reads shell output until needle shows up.
+ * @param  shell      shell to read from
+ * @param  needle     text to wait for, everything up to its end is consumed
+ * @param  timeoutMs  how long to wait
+ * @return            true if needle was seen in time
+ */
+bool shell_expect(struct shell *shell, const char *needle, int timeoutMs)
+{
+	size_t needleLength = strlen(needle);
+	long long deadline = now_ns() + timeoutMs * 1000000LL;
+
+	while (1)
+	{
+		char *found = memmem(shell->buffer, shell->length, needle, needleLength);
+		if (found != NULL)
+		{
+			size_t consumed = found - shell->buffer + needleLength;
+			memmove(shell->buffer, shell->buffer + consumed, shell->length - consumed);
+			shell->length -= consumed;
+			return true;
+		}
+
+		// keep only the tail that may hold the start of needle
+		if (shell->length == sizeof(shell->buffer))
+		{
+			memmove(shell->buffer, shell->buffer + shell->length - needleLength, needleLength);
+			shell->length = needleLength;
+		}
+
+		long long left = deadline - now_ns();
+		if (left <= 0)
+			return false;
+
+		struct pollfd pfd = {.fd = shell->master, .events = POLLIN};
+		if (poll(&pfd, 1, left / 1000000 + 1) <= 0)
+			continue;
+		ssize_t n = read(shell->master, shell->buffer + shell->length, sizeof(shell->buffer) - shell->length);
+		if (n <= 0)
+			return false;
+		shell->length += n;
+	}
+}
+
+/**
+ * Waits until any output arrives and drops it, used for keystroke echoes.
+ */
+bool shell_expect_any(struct shell *shell, int timeoutMs)
+{
+	struct pollfd pfd = {.fd = shell->master, .events = POLLIN};
+	if (shell->length > 0)
+	{
+		shell->length = 0;
+		return true;
+	}
+	if (poll(&pfd, 1, timeoutMs) <= 0)
+		return false;
+	return read(shell->master, shell->buffer, sizeof(shell->buffer)) > 0;
+}
+
+void shell_send(struct shell *shell, const char *text)
+{
+	size_t length = strlen(text);
+	while (length > 0)
+	{
+		ssize_t n = write(shell->master, text, length);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		text += n;
+		length -= n;
+	}
+}
+
+/**
+ * Starts the shell on a new pseudo terminal inside the work directory.
+ * @return false if it did not show a prompt
+ */
+bool shell_start(struct shell *shell, const char *binary)
+{
+	shell->length = 0;
+	shell->master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (shell->master < 0 || grantpt(shell->master) < 0 || unlockpt(shell->master) < 0)
+		return false;
+	const char *slave = ptsname(shell->master);
+
+	shell->pid = fork();
+	if (shell->pid == 0)
+	{
+		// the terminal opened after setsid becomes the controlling terminal
+		setsid();
+		int fd = open(slave, O_RDWR);
+		for (int i = 0; i < 3; ++i)
+			dup2(fd, i);
+		if (fd > 2)
+			close(fd);
+		if (chdir(work_dir) < 0)
+			_exit(127);
+
+		char histfile[4096];
+		snprintf(histfile, sizeof(histfile), "%s/.shellfyre_history", work_dir);
+		setenv("SHELLFYRE_PROMPT", prompt_marker, 1);
+		setenv("SHELLFYRE_HISTFILE", histfile, 1);
+		setenv("HOME", work_dir, 1);
+		execl(binary, binary, (char *)NULL);
+		_exit(127);
+	}
+	return shell->pid > 0 && shell_expect(shell, prompt_marker, 5000);
+}
+
+void shell_stop(struct shell *shell)
+{
+	shell_send(shell, "exit\r");
+	for (int i = 0; i < 100 && waitpid(shell->pid, NULL, WNOHANG) == 0; ++i)
+		usleep(10000);
+	if (waitpid(shell->pid, NULL, WNOHANG) == 0)
+	{
+		kill(shell->pid, SIGKILL);
+		waitpid(shell->pid, NULL, 0);
+	}
+	close(shell->master);
+}
+
+/**
+ * Runs one command line and returns the time until the next prompt.
+ */
+long long shell_run(struct shell *shell, const char *line)
+{
+	char input[8192];
+	snprintf(input, sizeof(input), "%s\r", line);
+
+	long long start = now_ns();
+	shell_send(shell, input);
+	if (!shell_expect(shell, prompt_marker, 60000))
+	{
+		fprintf(stderr, "shellfyre_bench: no prompt after \"%s\"\n", line);
+		return -1;
+	}
+	return now_ns() - start;
+}
+
+/**
+ * Runs a command without measuring it, to set up the next measurement.
+ */
+void shell_prepare(struct shell *shell, const char *line)
+{
+	shell_run(shell, line);
+}
+
+void workload_keystroke(struct shell *shell, struct samples *samples, int iterations)
+{
+	static const char text[] = "filesearch -r benchmark_keystroke_latency ";
+
+	for (int i = 0; i < iterations; ++i)
+	{
+		char key[2] = {text[i % (sizeof(text) - 1)], '\0'};
+		long long start = now_ns();
+		shell_send(shell, key);
+		if (!shell_expect_any(shell, 5000))
+			return;
+		samples_add(samples, now_ns() - start);
+
+		if (i % 64 == 63)
+		{
+			shell_send(shell, "\x15"); // Ctrl+U, keep the line short
+			shell_expect_any(shell, 5000);
+		}
+	}
+	shell_send(shell, "\x15");
+	shell_expect_any(shell, 5000);
+}
+
+void workload_cd(struct shell *shell, struct samples *samples, int iterations)
+{
+	char line[256];
+	for (int i = 0; i < iterations; ++i)
+	{
+		snprintf(line, sizeof(line), "cd %s/wide/d%03d", work_dir, i % 200);
+		samples_add(samples, shell_run(shell, line));
+	}
+	snprintf(line, sizeof(line), "cd %s", work_dir);
+	shell_prepare(shell, line);
+}
+
+void workload_cdh(struct shell *shell, struct samples *samples, int iterations)
+{
+	char line[256];
+	for (int i = 0; i < 5; ++i)
+	{
+		snprintf(line, sizeof(line), "cd %s/wide/d%03d", work_dir, i);
+		shell_prepare(shell, line);
+	}
+
+	for (int i = 0; i < iterations; ++i)
+	{
+		long long start = now_ns();
+		shell_send(shell, "cdh\r");
+		if (!shell_expect(shell, "Select directory", 5000))
+			return;
+		shell_send(shell, i % 2 ? "2\r" : "b\r");
+		if (!shell_expect(shell, prompt_marker, 5000))
+			return;
+		samples_add(samples, now_ns() - start);
+	}
+	snprintf(line, sizeof(line), "cd %s", work_dir);
+	shell_prepare(shell, line);
+}
+
+void workload_take(struct shell *shell, struct samples *samples, int iterations)
+{
+	char line[4096];
+	for (int i = 0; i < iterations; ++i)
+	{
+		int length = snprintf(line, sizeof(line), "take deep/t%d", i);
+		for (int depth = 0; depth < 32; ++depth)
+			length += snprintf(line + length, sizeof(line) - length, "/level%02d", depth);
+		samples_add(samples, shell_run(shell, line));
+
+		snprintf(line, sizeof(line), "cd %s", work_dir);
+		shell_prepare(shell, line);
+	}
+}
+
+void workload_create(struct shell *shell, struct samples *samples, int iterations)
+{
+	char line[256];
+	snprintf(line, sizeof(line), "cd %s/wide", work_dir);
+	shell_prepare(shell, line);
+
+	for (int i = 0; i < iterations; ++i)
+	{
+		snprintf(line, sizeof(line), "create c%d", i);
+		samples_add(samples, shell_run(shell, line));
+	}
+	snprintf(line, sizeof(line), "cd %s", work_dir);
+	shell_prepare(shell, line);
+}
+
+void workload_filesearch(struct shell *shell, struct samples *samples, int iterations)
+{
+	char line[256];
+	snprintf(line, sizeof(line), "cd %s/tree", work_dir);
+	shell_prepare(shell, line);
+
+	for (int i = 0; i < iterations; ++i)
+		samples_add(samples, shell_run(shell, i % 2 ? "filesearch -r needle > /dev/null" : "filesearch -r file_7 > /dev/null"));
+
+	snprintf(line, sizeof(line), "cd %s", work_dir);
+	shell_prepare(shell, line);
+}
+
+void workload_exec(struct shell *shell, struct samples *samples, int iterations)
+{
+	for (int i = 0; i < iterations; ++i)
+		samples_add(samples, shell_run(shell, i % 2 ? "true" : "/bin/true"));
+}
+
+void workload_pipeline(struct shell *shell, struct samples *samples, int iterations)
+{
+	for (int i = 0; i < iterations; ++i)
+		samples_add(samples, shell_run(shell, "echo benchmark | cat | cat | wc -c > /dev/null"));
+}
+
+static const struct workload workloads[] = {
+	{"keystroke", workload_keystroke, 1},
+	{"cd", workload_cd, 1},
+	{"cdh", workload_cdh, 2},
+	{"take", workload_take, 4},
+	{"create", workload_create, 4},
+	{"filesearch", workload_filesearch, 10},
+	{"exec", workload_exec, 1},
+	{"pipeline", workload_pipeline, 1},
+};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+/**
+ * Creates the directories the workloads run in: 200 siblings for cd and create, and a
+ * tree of 4 levels with 6 directories and 10 files each for filesearch.
+ */
+void make_fixtures()
+{
+	char path[4096];
+
+	snprintf(path, sizeof(path), "%s/wide", work_dir);
+	mkdir(path, 0755);
+	for (int i = 0; i < 200; ++i)
+	{
+		snprintf(path, sizeof(path), "%s/wide/d%03d", work_dir, i);
+		mkdir(path, 0755);
+	}
+
+	// breadth first over the tree, directory i has children 6i+1 .. 6i+6
+	static char directories[1 + 6 + 36 + 216 + 1296][128];
+	int count = 1;
+	snprintf(directories[0], sizeof(directories[0]), "tree");
+	for (int i = 0; i < count; ++i)
+	{
+		snprintf(path, sizeof(path), "%s/%s", work_dir, directories[i]);
+		mkdir(path, 0755);
+		for (int f = 0; f < 10; ++f)
+		{
+			snprintf(path, sizeof(path), "%s/%s/file_%d%s", work_dir, directories[i], f, i == 777 ? "_needle" : "");
+			close(open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+		}
+		for (int d = 0; d < 6 && count < (int)(sizeof(directories) / sizeof(directories[0])); ++d)
+		{
+			snprintf(directories[count], sizeof(directories[count]), "%.100s/s%d", directories[i], d);
+			count++;
+		}
+	}
+}
+
+int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	remove(path);
+	return 0;
+}
+
+int compare_long_long(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+double percentile_us(struct samples *samples, double percentile)
+{
+	int index = (int)(percentile * (samples->count - 1) + 0.5);
+	return samples->values[index] / 1e3;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *binary = "./shellfyre";
+	const char *output = "bench.json";
+	const char *selected = NULL;
+	int iterations = 200;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:n:o:w:")) != -1)
+	{
+		switch (opt)
+		{
+		case 's':
+			binary = optarg;
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'w':
+			selected = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s shellfyre] [-n iterations] [-o out.json] [-w workload,...]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	char resolved[4096];
+	if (realpath(binary, resolved) == NULL || mkdtemp(work_dir) == NULL)
+	{
+		fprintf(stderr, "shellfyre_bench: %s: %s\n", binary, strerror(errno));
+		return 1;
+	}
+	make_fixtures();
+
+	FILE *json = strcmp(output, "-") == 0 ? stdout : fopen(output, "w");
+	if (json == NULL)
+	{
+		fprintf(stderr, "shellfyre_bench: %s: %s\n", output, strerror(errno));
+		return 1;
+	}
+
+	fprintf(json, "{\n  \"shell\": \"%s\",\n  \"iterations\": %d,\n  \"time\": %lld,\n  \"workloads\": {", resolved,
+			iterations, (long long)time(NULL));
+	fprintf(stderr, "%-12s %8s %10s %10s %10s %10s %10s\n", "workload", "samples", "mean(us)", "p50(us)", "p90(us)",
+			"p99(us)", "max(us)");
+
+	bool first = true;
+	int status = 0;
+	for (size_t w = 0; w < WORKLOAD_COUNT; ++w)
+	{
+		const struct workload *workload = &workloads[w];
+		if (selected != NULL)
+		{
+			// match whole names in the comma separated list
+			size_t length = strlen(workload->name);
+			const char *at = strstr(selected, workload->name);
+			while (at != NULL && !((at == selected || at[-1] == ',') && (at[length] == ',' || at[length] == '\0')))
+				at = strstr(at + 1, workload->name);
+			if (at == NULL)
+				continue;
+		}
+
+		// every workload gets a fresh shell so earlier ones do not influence it
+		struct shell shell;
+		struct samples samples = {0};
+		if (!shell_start(&shell, resolved))
+		{
+			fprintf(stderr, "shellfyre_bench: %s did not show a prompt\n", resolved);
+			status = 1;
+			break;
+		}
+		int runs = iterations / workload->divisor;
+		workload->run(&shell, &samples, runs > 0 ? runs : 1);
+		shell_stop(&shell);
+
+		int valid = 0;
+		long long total = 0;
+		for (int i = 0; i < samples.count; ++i)
+			if (samples.values[i] >= 0)
+			{
+				samples.values[valid++] = samples.values[i];
+				total += samples.values[i];
+			}
+		samples.count = valid;
+		if (valid == 0)
+		{
+			fprintf(stderr, "%-12s failed\n", workload->name);
+			status = 1;
+			free(samples.values);
+			continue;
+		}
+		qsort(samples.values, samples.count, sizeof(long long), compare_long_long);
+
+		double mean = total / 1e3 / samples.count;
+		fprintf(stderr, "%-12s %8d %10.1f %10.1f %10.1f %10.1f %10.1f\n", workload->name, samples.count, mean,
+				percentile_us(&samples, 0.5), percentile_us(&samples, 0.9), percentile_us(&samples, 0.99),
+				percentile_us(&samples, 1));
+		fprintf(json, "%s\n    \"%s\": {\"samples\": %d, \"mean_us\": %.1f, \"min_us\": %.1f, \"p50_us\": %.1f, "
+					  "\"p90_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}",
+				first ? "" : ",", workload->name, samples.count, mean, percentile_us(&samples, 0),
+				percentile_us(&samples, 0.5), percentile_us(&samples, 0.9), percentile_us(&samples, 0.99),
+				percentile_us(&samples, 1));
+		first = false;
+		free(samples.values);
+	}
+	fprintf(json, "\n  }\n}\n");
+	if (json != stdout)
+		fclose(json);
+
+	nftw(work_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return status;
+}
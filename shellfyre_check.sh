@@ -0,0 +1,88 @@
+#!/bin/sh
+# Exit status and I/O checks of the shell, run by make check.
+#    shellfyre_check.sh [shell]
+# Every check runs the shell on a line with -c (or on stdin) in a scratch directory and
+# compares the exit status or the output. Prints the failures and exits non-zero if any.
+SHELL_UNDER_TEST=$(cd "$(dirname "${1:-./shellfyre}")" && pwd)/$(basename "${1:-./shellfyre}")
+SCRATCH=$(mktemp -d)
+trap 'rm -rf "$SCRATCH"' EXIT
+cd "$SCRATCH" || exit 1
+
+failures=0
+checks=0
+
+# status LINE EXPECTED: the shell exits with EXPECTED after running LINE
+status()
+{
+	checks=$((checks + 1))
+	"$SHELL_UNDER_TEST" -c "$1" >/dev/null 2>&1 </dev/null
+	actual=$?
+	if [ "$actual" != "$2" ]; then
+		echo "FAIL: '$1' exited $actual, expected $2"
+		failures=$((failures + 1))
+	fi
+}
+
+# piped SCRIPT EXPECTED: the shell prints EXPECTED when SCRIPT comes through a pipe and
+# when it comes from a file on stdin
+piped()
+{
+	for source in pipe file; do
+		checks=$((checks + 1))
+		if [ "$source" = pipe ]; then
+			actual=$(printf "$1" | "$SHELL_UNDER_TEST" 2>&1)
+		else
+			printf "$1" > script.txt
+			actual=$("$SHELL_UNDER_TEST" < script.txt 2>&1)
+		fi
+		if [ "$actual" != "$(printf "$2")" ]; then
+			echo "FAIL: '$1' from a $source printed '$actual', expected '$2'"
+			failures=$((failures + 1))
+		fi
+	done
+}
+
+# builtins forked as pipeline stages report their own status
+status 'echo hi | cd /nonexistent_dir' 1
+status 'echo hi | cd /' 0
+status 'true | exit 3' 3
+
+# a pipeline exits with the status of its last stage, even when that one never started
+status 'true | nosuchcmd_zz' 127
+status 'false | nosuchcmd_zz' 127
+status 'nosuchcmd_zz | true' 0
+status 'true | cat < /nonexistent_file' 1
+status 'ls |' 2
+
+# commands reading stdin get the lines after their own, the shell does not read ahead
+piped 'cat\nhello from stdin\n' 'hello from stdin'
+piped 'sh -c "read line; echo got \\$line"\nfirst\necho after\n' 'got first\nafter'
+
+# filesearch -r finds entries below more directories than it may hold open at once
+deep=deep
+level=0
+while [ "$level" -lt 40 ]; do
+	level=$((level + 1))
+	deep=$deep/d$level
+done
+mkdir -p "$deep" && touch "$deep/needle_deep"
+checks=$((checks + 1))
+actual=$( (ulimit -n 16; "$SHELL_UNDER_TEST" -c 'filesearch -r -j 1 needle_deep') 2>&1)
+if [ "$actual" != "./$deep/needle_deep" ]; then
+	echo "FAIL: 'filesearch -r' under ulimit -n 16 printed '$actual'"
+	failures=$((failures + 1))
+fi
+
+# filesearch -I does not answer from an index a change below the root made stale
+mkdir -p indexed/a/b index && sleep 1
+checks=$((checks + 1))
+actual=$(cd indexed && export SHELLFYRE_INDEX_DIR="$SCRATCH/index" &&
+	"$SHELL_UNDER_TEST" -c 'filesearch --index-build' && touch a/b/needle_new &&
+	"$SHELL_UNDER_TEST" -c 'filesearch -I needle_new' 2>&1)
+if [ "$actual" != "./a/b/needle_new" ]; then
+	echo "FAIL: 'filesearch -I' after a change in a subdirectory printed '$actual'"
+	failures=$((failures + 1))
+fi
+
+echo "$checks checks, $failures failed"
+[ "$failures" -eq 0 ]